@@ -1,89 +1,486 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
 #include "avllq.h"
 
+/* latency tracking is compiled in by default, build with MSU_AVLLQ_LATENCY=0 to remove it */
+#ifndef MSU_AVLLQ_LATENCY
+#define MSU_AVLLQ_LATENCY               1
+#endif
+
+/*
+ * Item data lives in buffers referenced by the slots. The slot holds one reference to its buffer, every
+ * borrower holds another one. The producer writes in place only if the slot is the single owner, a pinned
+ * buffer is swapped out for a spare one and goes to the spare list once the last borrower returns it.
+ */
+/* overridable for layout comparisons, e.g. -DMSU_AVLLQ_CACHE_LINE=8 packs the control state like before */
+#ifndef MSU_AVLLQ_CACHE_LINE
+#define MSU_AVLLQ_CACHE_LINE            64
+#endif
+#define MSU_AVLLQ_BUF_ALIGN             MSU_AVLLQ_CACHE_LINE
+#define MSU_AVLLQ_HUGE_PAGE_SIZE        (2 * 1024 * 1024)
+
+typedef struct msu_avllq_buf_s {
+    _Atomic int                 ref_count;                          /* zero means on the spare list */
+    struct msu_avllq_buf_s     *next;                               /* spare list link */
+    struct msu_avllq_buf_s     *all_next;                           /* link of heap buffers, for destroy */
+    _Alignas(MSU_AVLLQ_BUF_ALIGN) uint8_t data[];                   /* aligned for SIMD copies */
+} msu_avllq_buf_t;
+
+/*
+ * Every slot is protected by a seqlock. While the producer is writing item N into a slot, the slot
+ * sequence is 2 * N + 1 (odd); once published, it is 2 * N + 2 (even). A consumer expecting item N
+ * copies the slot and checks the sequence before and after the copy, a mismatch means the producer
+ * has overwritten the slot in the meantime, and the consumer retries with a newer item.
+ */
+typedef struct msu_avllq_slot_s {
+    _Alignas(MSU_AVLLQ_CACHE_LINE)                                  /* producer writes next slot while consumers read */
+    _Atomic uint64_t    seq;                                        /* seqlock word of the slot */
+    _Atomic size_t      len;
+    _Atomic int         type;
+    msu_avllq_buf_t * _Atomic buf;                                  /* item data, buffer mode */
+    _Atomic uint64_t    pos;                                        /* byte position of item data, ring mode */
+    _Atomic uint64_t    stamp;                                      /* CLOCK_MONOTONIC ns of publish, latency tracking */
+} msu_avllq_slot_t;
+
+/*
+ * Consumed items are copied into buffers with this header in front, so msu_avllq_item_release() finds the pool
+ * they go back to without the queue handle.
+ */
+typedef struct msu_avllq_out_s {
+    struct msu_avllq_pool_s    *pool;                               /* NULL if malloc()ed */
+    struct msu_avllq_out_s     *next;                               /* free list link */
+    uint8_t                     data[];
+} msu_avllq_out_t;
+
+/*
+ * Output buffer pool of a consumer registration. Free buffers are popped by the consumer only and pushed back
+ * from any thread onto a second list, which the consumer takes over in one exchange when its own runs dry.
+ * The registration and every buffer handed out hold a reference, so items may outlive their consumer.
+ */
+typedef struct msu_avllq_pool_s {
+    _Atomic int                 refs;
+    _Atomic int                 closed;                             /* consumer deregistered, free on release */
+    msu_avllq_out_t            *local;                              /* free buffers, consumer only */
+    msu_avllq_out_t * _Atomic   returned;                           /* released buffers */
+    pthread_mutex_t             mutex;                              /* serializes the members of a group */
+    size_t                      size;                               /* max_item_size */
+    void                     *(*alloc)(void *ctx, size_t size);     /* caller allocator, no free lists */
+    void                      (*free)(void *ctx, void *ptr);
+    void                       *ctx;
+} msu_avllq_pool_t;
+
+/* spill policy, the copy of an item which dropped out of the window before the consumer read it */
+typedef struct msu_avllq_spill_s {
+    struct msu_avllq_spill_s   *next;
+    uint64_t                    seq;
+    size_t                      len;
+    int                         type;
+    uint64_t                    stamp;
+    void                       *data;                               /* handed out as the consumed item */
+} msu_avllq_spill_t;
+
+/*
+ * In ring mode, item data is packed back to back into one byte ring instead of a max_item_size buffer
+ * per slot. Byte positions are monotonically increasing like item sequences, an item never wraps around
+ * the end of the ring. Before overwriting bytes the producer raises min_valid_pos, which works as a
+ * second seqlock: a consumer whose item starts below min_valid_pos after the copy drops the item.
+ */
+
+/*
+ * Consumer registry entry. The consumer id encodes the entry index in its low bits and a per entry
+ * generation above, so looking up a consumer is a mask and a compare.
+ */
+typedef struct msu_avllq_consumer_s {
+    _Alignas(MSU_AVLLQ_CACHE_LINE)                                  /* one cache line per consumer */
+    _Atomic int         id;                                         /* consumer id, -1 means "not exist" */
+    _Atomic uint64_t    rd_seq;                                     /* local read seq */
+    _Atomic uint32_t    waiting;                                    /* futex word, 1 means consumer is parked */
+    _Atomic int         event_fd;                                   /* readiness eventfd, -1 means not created */
+    _Atomic int         event_signaled;                             /* 1 means event_fd is readable */
+    int                 generation;                                 /* bumped on every register of the entry */
+    int                 group;                                      /* consumer group, 0 if not shared */
+    int                 members;                                    /* registrations sharing the entry */
+    int                 need_sync;                                  /* keyframe policy, skip to the next keyframe */
+    uint64_t            key_floor;                                  /* keyframe policy, keyframes before it were seen */
+    uint64_t            overrun_floor;                              /* start seq, items before it are no overrun */
+    _Atomic uint64_t    stat_consumed;                              /* statistics, written by the consumer only */
+    _Atomic uint64_t    stat_overrun;
+    _Atomic uint64_t    stat_max_lag;
+    _Atomic uint64_t   *latency;                                    /* latency histogram, written by the consumer only */
+    uint64_t           *latency_base;                               /* histogram at the last reset */
+    msu_avllq_policy_t  policy;                                     /* what produce does before dropping an unread item */
+    int64_t             block_timeout_ns;
+    uint32_t            spill_limit;
+    _Atomic uint32_t    spill_count;                                /* spilled items not taken yet */
+    msu_avllq_spill_t  *spill_head;                                 /* spilled items in seq order */
+    msu_avllq_spill_t  *spill_tail;
+    pthread_mutex_t     spill_mutex;                                /* guards the spilled items */
+    msu_avllq_pool_t   *pool;                                       /* buffers of consumed items */
+} msu_avllq_consumer_t;
+
+/*
+ * Fields are grouped by writer: the read-mostly configuration, the producer cursor and the state shared
+ * with consumers each start a cache line, so a consumer updating its cursor never invalidates the line
+ * of the producer and the other way around.
+ */
 typedef struct msu_avllq_s {
-    msu_avllq_item_t   *buf_array;                                  /* all buf_item */
-    uint8_t             wr_off;                                     /* producer write ptr */
-    uint8_t             rd_off;                                     /* global read ptr */
-    uint8_t             rd_off_local[MSU_AVLLQ_MAX_CONSUMER];       /* local read ptr */
-    uint8_t             capacity;                                   /* how many items in queue, NOT the total bytes */
-    int                 consumer[MSU_AVLLQ_MAX_CONSUMER];           /* consumer flag, -1 means "not exist" */
-    int                 consumer_id_seq_no;
+    /* read-mostly after create */
+    msu_avllq_slot_t   *slots;                                      /* per item seqlock and meta data */
+    uint32_t            capacity;                                   /* how many items in queue, NOT the total bytes */
+    uint32_t            capacity_mask;                              /* capacity - 1 if a power of two, else 0 */
     int                 max_item_size;
-    void              **preserved_buf;                              /* pre-allocated buffer */
-    pthread_mutex_t     mutex;                                      /* struct mutex */
+    msu_avllq_consumer_t *consumers;                                /* consumer registry */
+    int                 max_consumers;
+    int                 map_words;                                  /* number of 64 bit words in each bitmap */
+    _Atomic uint64_t   *live_map;                                   /* registered consumers */
+    _Atomic uint64_t   *notify_map;                                 /* consumers parked or waiting for eventfd */
+    uint8_t            *slab;                                       /* preserved buffers or byte ring, may be NULL */
+    size_t              slab_size;
+    int                 slab_mapped;                                /* 1 if slab comes from mmap() */
+    size_t              ring_bytes;                                 /* byte ring size, 0 means buffer mode */
+    size_t              ring_mask;                                  /* ring_bytes - 1 if a power of two, else 0 */
+    int                 keyframe_policy;                            /* consumers join and resync at keyframes */
+    int                 keyframe_type;
+    int                 track_latency;                              /* stamp items and keep latency histograms */
+    int                 producers;                                  /* items filled in parallel, 1 is single producer */
+    int                 lossless;                                   /* produce fails instead of overwriting unread items */
+
+    /* producer */
+    _Alignas(MSU_AVLLQ_CACHE_LINE)
+    _Atomic uint64_t    wr_seq;                                     /* producer write seq, next item to write */
+    _Atomic uint64_t    min_valid_pos;                              /* ring mode, bytes before it are overwritten */
+    uint64_t            ring_wr_pos;                                /* ring mode, next byte position to write */
+    uint8_t            *reserved_data;                              /* producer only, reserved but not committed */
+    size_t              reserved_len;
+    uint64_t            reserved_pos;                               /* ring mode, byte position of reserved_data */
+    _Atomic uint64_t    key_seq;                                    /* latest keyframe, MSU_AVLLQ_INVALID_SEQ if none */
+    msu_avllq_buf_t * _Atomic key_buf;                              /* buffer mode, latest keyframe pinned by a ref */
+    _Atomic size_t      key_len;
+    msu_avllq_buf_t    *all_bufs;                                   /* all heap allocated buffers */
+    _Atomic uint64_t    claim_seq;                                  /* multi producer, next ticket to hand out */
+    _Atomic uint64_t    publish_turn;                               /* multi producer, ticket allowed to publish */
+    pthread_mutex_t     buf_mutex;                                  /* multi producer, serializes spare pops */
+    uint64_t            slowest_seq;                                /* lossless, lower bound of the slowest read seq */
+    uint64_t            slowest_gen;                                /* lossless, consumer_gen slowest_seq was taken at */
+
+    /* written by consumers, rarely */
+    _Alignas(MSU_AVLLQ_CACHE_LINE)
+    msu_avllq_buf_t * _Atomic spare_bufs;                           /* unused buffers, popped by producer only */
+    _Atomic uint64_t    rd_seq;                                     /* global read seq left by deregistered consumers */
+    _Atomic int         policy_consumers;                           /* consumers with a block or spill policy */
+    _Atomic uint32_t    producer_waiting;                           /* futex word, 1 means producer waits for a consumer */
+    _Atomic uint64_t    consumer_gen;                               /* bumped by every registration */
+    pthread_mutex_t     mutex;                                      /* protects consumer registration */
 } *msu_avllq_handle_t;
 
+/* multi lane queue, one queue per lane and the consumer ids of every lane consumer in each of them */
+typedef struct msu_avllq_lanes_s {
+    int                 nr_lanes;
+    int                 types[MSU_AVLLQ_MAX_LANES];                 /* item type of each lane */
+    msu_avllq_handle_t  lanes[MSU_AVLLQ_MAX_LANES];                 /* in priority order */
+    int                 max_consumers;                              /* the smallest max_consumers of the lanes */
+    _Atomic int        *consumers;                                  /* lanes consumer id per entry, -1 if free */
+    int                *generations;
+    int                *lane_consumers;                             /* nr_lanes consumer ids per entry */
+    pthread_mutex_t     mutex;                                      /* protects consumer registration */
+} *msu_avllq_lanes_handle_t;
+
+
+/*
+ * Read and write positions are monotonically increasing item sequence numbers, the slot of item N is
+ * N % capacity. One slot is always kept empty, so at most (capacity - 1) items are readable. With multiple
+ * producers one slot per producer is kept out of the window, so they can fill slots in parallel.
+ *
+ * A power of two capacity or ring size is detected at create, the modulo is then a mask instead of a division.
+ */
+#define MSU_AVLLQ_WINDOW(H)                ( (uint64_t)(H)->capacity - (H)->producers )
+#define MSU_AVLLQ_OLDEST_SEQ(H, W)         ( (W) > MSU_AVLLQ_WINDOW(H) ? (W) - MSU_AVLLQ_WINDOW(H) : 0 )
+
+#define IS_POW2(X)                      ( ((X) & ((X) - 1)) == 0 )
+#define WRAP(X, N, MASK)                ( (MASK) ? (X) & (MASK) : (X) % (N) )
+#define SLOT_INDEX(H, SEQ)              WRAP((SEQ), (H)->capacity, (H)->capacity_mask)
+#define RING_OFFSET(H, POS)             WRAP((POS), (H)->ring_bytes, (H)->ring_mask)
+#define SEQLOCK_WRITING(SEQ)            ( 2 * (SEQ) + 1 )
+#define SEQLOCK_PUBLISHED(SEQ)          ( 2 * (SEQ) + 2 )
+
+/* an item produce_n() can publish, a zero length would read as a given up ticket with multiple producers */
+#define ITEM_VALID(H, IT)               ( (IT)->data != NULL && (IT)->len > 0 && (IT)->len <= (size_t)(H)->max_item_size )
+
+#define ALIGN_UP(X, A)                  ( ((X) + (A) - 1) / (A) * (A) )
+#define BUF_STRIDE(H)                   ALIGN_UP(sizeof(msu_avllq_buf_t) + (H)->max_item_size, MSU_AVLLQ_BUF_ALIGN)
 
-#define MSU_AVLLQ_BUF_SIZE(H)              ( ((H)->wr_off + (H)->capacity - (H)->rd_off) % ((H)->capacity) )
-#define MSU_AVLLQ_IS_GLOBAL_EMPTY(H)       ( (H)->wr_off == (H)->rd_off )
-#define MSU_AVLLQ_IS_GLOBAL_FULL(H)        ( ((H)->wr_off + 1) % (H)->capacity == (H)->rd_off )
-#define MSU_AVLLQ_IS_LOCAL_EMPTY(H, I)     ( (H)->wr_off == (H)->rd_off_local[(I)] )
-#define MSU_AVLLQ_IS_LOCAL_FULL(H, I)      ( ((H)->wr_off + 1) % (H)->capacity == (H)->rd_off_local[(I)] )
+#define BUF_OF_DATA(D)                  ( (msu_avllq_buf_t *)((uint8_t *)(D) - offsetof(msu_avllq_buf_t, data)) )
+#define OUT_OF_DATA(D)                  ( (msu_avllq_out_t *)((uint8_t *)(D) - offsetof(msu_avllq_out_t, data)) )
 
-#define NEXT_OFFSET(H, OFF)             ( ((OFF) + 1) % (H)->capacity )
-#define ADVANCE_WR_OFF(H)               ( (H)->wr_off = ((H)->wr_off + 1) % (H)->capacity )
-#define ADVANCE_GLOBAL_RD_OFFSET(H)     ( (H)->rd_off = ((H)->rd_off + 1) % (H)->capacity )
-#define ADVANCE_LOCAL_RD_OFFSET(H, I)   ( (H)->rd_off_local[(I)] = ((H)->rd_off_local[(I)] + 1) % (H)->capacity )
+#define CONSUMER_INDEX_BITS             16
+#define CONSUMER_INDEX_MASK             ( (1 << CONSUMER_INDEX_BITS) - 1 )
+#define CONSUMER_GENERATION_MASK        ( INT32_MAX >> CONSUMER_INDEX_BITS )
+#define CONSUMER_ID(GEN, I)             ( ((GEN) << CONSUMER_INDEX_BITS) | (I) )
+
+#define CONSUMER_EXISTS(H, I)           ( atomic_load_explicit(&(H)->consumers[(I)].id, memory_order_relaxed) != -1 )
+
+/* statistics have a single writer, a plain load and store is enough */
+#define STAT_ADD(V, N)                  atomic_store_explicit(&(V), atomic_load_explicit(&(V), memory_order_relaxed) + (N), \
+                                                              memory_order_relaxed)
+/* the members of a consumer group update the statistics of the group concurrently */
+#define STAT_ADD_SHARED(V, N)           atomic_fetch_add_explicit(&(V), (N), memory_order_relaxed)
+
+/*
+ * Latency histograms are log bucketed like HDR histograms: values below 16 ns have a bucket each, above
+ * that every power of two is split into 8 buckets, so a bucket is accurate to 1/8 of its value.
+ */
+#define LATENCY_SUB_BITS                3
+#define LATENCY_LINEAR                  ( 2 << LATENCY_SUB_BITS )
+#define LATENCY_BUCKETS                 ( LATENCY_LINEAR + (64 - LATENCY_SUB_BITS - 1) * (1 << LATENCY_SUB_BITS) )
 
+#if MSU_AVLLQ_LATENCY
+#define LATENCY_STAMP(SLOT)             atomic_load_explicit(&(SLOT)->stamp, memory_order_relaxed)
+#define LATENCY_RECORD(H, C, STAMP)     msu_avllq_latency_record((H), (C), (STAMP))
+#else
+#define LATENCY_STAMP(SLOT)             0
+#define LATENCY_RECORD(H, C, STAMP)     ((void)(STAMP))
+#endif
 
-#define CONSUMER_EXISTS(H, I)           ( (H)->consumer[(I)] != -1 )
+#define MAP_WORD(I)                     ( (I) / 64 )
+#define MAP_BIT(I)                      ( UINT64_C(1) << ((I) % 64) )
 
 static int msu_avllq_find_consumer_index(msu_avllq_handle_t q, int consumer_id);
 static int msu_avllq_compare_read_speed2(msu_avllq_handle_t q, int consumer_index);
+static uint64_t msu_avllq_global_rd_seq(msu_avllq_handle_t q, uint64_t wr_seq);
+static uint64_t msu_avllq_local_rd_seq(msu_avllq_handle_t q, int consumer_index, uint64_t wr_seq);
+static uint64_t msu_avllq_slowest_rd_seq2(msu_avllq_handle_t q, uint64_t wr_seq);
+static void msu_avllq_advance_global_rd_seq(msu_avllq_handle_t q, uint64_t seq);
+static msu_avllq_slot_t *msu_avllq_next_readable(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor,
+                                                 uint64_t *rd_seq, uint64_t *seq);
+static msu_avllq_status_t msu_avllq_copy_next(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor,
+                                              msu_avllq_item_t *item, void *dst, size_t cap);
+static uint64_t msu_avllq_keyframe_sync(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t cursor);
+static msu_avllq_buf_t *msu_avllq_pinned_keyframe(msu_avllq_handle_t q, msu_avllq_consumer_t *c, size_t *len);
+static void msu_avllq_pin_keyframe(msu_avllq_handle_t q, uint64_t seq, msu_avllq_slot_t *slot, size_t len);
+static void msu_avllq_catch_up(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor, uint64_t wr_seq);
+static void msu_avllq_lose_sync(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t cursor);
+static void msu_avllq_account(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t rd_seq);
+static msu_avllq_status_t msu_avllq_group_consume(msu_avllq_handle_t q, int consumer_index, msu_avllq_item_t *item,
+                                                  void *dst, size_t cap);
+static msu_avllq_status_t msu_avllq_claimed_copy(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t rd_seq,
+                                                 msu_avllq_item_t *item, void *dst, size_t cap);
+#if MSU_AVLLQ_LATENCY
+static uint64_t msu_avllq_now_ns(void);
+static int msu_avllq_latency_bucket(uint64_t ns);
+static uint64_t msu_avllq_latency_bucket_max(int bucket);
+static void msu_avllq_latency_record(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t stamp);
+#endif
+static uint64_t msu_avllq_cursor(msu_avllq_handle_t q, int consumer_index);
+static void msu_avllq_consumed(msu_avllq_handle_t q, int consumer_index, uint64_t cursor);
+static msu_avllq_buf_t *msu_avllq_buf_alloc(msu_avllq_handle_t q);
+static int msu_avllq_slab_alloc(msu_avllq_handle_t q, size_t size);
+static uint8_t *msu_avllq_ring_reserve(msu_avllq_handle_t q, size_t len);
+static void *msu_avllq_aligned_calloc(size_t n, size_t size);
+static msu_avllq_buf_t *msu_avllq_writable_buf(msu_avllq_handle_t q, msu_avllq_slot_t *slot);
+static int msu_avllq_buf_try_ref(msu_avllq_buf_t *buf);
+static void msu_avllq_buf_unref(msu_avllq_handle_t q, msu_avllq_buf_t *buf);
+static void *msu_avllq_reserve_slot(msu_avllq_handle_t q, size_t len);
+static int msu_avllq_lossless_full(msu_avllq_handle_t q);
+static msu_avllq_status_t msu_avllq_make_room(msu_avllq_handle_t q);
+static int msu_avllq_block_wait(msu_avllq_handle_t q, int consumer_index, uint64_t seq, const struct timespec *start);
+static void msu_avllq_wake_producer(msu_avllq_handle_t q);
+static int msu_avllq_spill(msu_avllq_handle_t q, int consumer_index, uint64_t seq);
+static msu_avllq_status_t msu_avllq_take_spilled(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor,
+                                                 msu_avllq_item_t *item);
+static void msu_avllq_drop_spilled(msu_avllq_consumer_t *c, uint64_t seq);
+static msu_avllq_pool_t *msu_avllq_pool_create(msu_avllq_handle_t q, const msu_avllq_consumer_config_t *config);
+static void msu_avllq_pool_close(msu_avllq_pool_t *pool);
+static void msu_avllq_pool_unref(msu_avllq_pool_t *pool);
+static void *msu_avllq_out_alloc(msu_avllq_consumer_t *c, size_t len);
+static void msu_avllq_out_free(void *data);
+static void *msu_avllq_out_get(msu_avllq_consumer_t *c, void *dst, size_t len);
+static void msu_avllq_out_put(void *data, void *dst);
+static void msu_avllq_publish(msu_avllq_handle_t q, size_t len, int type);
+static void msu_avllq_mp_wait(_Atomic uint64_t *seq, uint64_t target);
+static uint8_t *msu_avllq_mp_claim(msu_avllq_handle_t q, uint64_t ticket);
+static void msu_avllq_mp_publish(msu_avllq_handle_t q, uint64_t ticket, size_t len, int type);
+static void msu_avllq_wake_consumers(msu_avllq_handle_t q);
+static void msu_avllq_event_signal(msu_avllq_handle_t q, int consumer_index);
+static void msu_avllq_event_clear(msu_avllq_handle_t q, int consumer_index);
+static void msu_avllq_event_sync(msu_avllq_handle_t q, int consumer_index);
+static void msu_avllq_request_notify(msu_avllq_handle_t q, int consumer_index);
+
+msu_avllq_handle_t msu_avllq_create(uint32_t capacity, int max_item_size)
+{
+    msu_avllq_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    config.capacity = capacity;
+    config.max_item_size = max_item_size;
+
+    return msu_avllq_create2(&config);
+}
 
-msu_avllq_handle_t msu_avllq_create(uint8_t capacity, int max_item_size)
+msu_avllq_handle_t msu_avllq_create2(const msu_avllq_config_t *config)
 {
+    assert(config != NULL);
+
+    uint32_t capacity = config->capacity;
+    int max_item_size = config->max_item_size;
+    int max_consumers = config->max_consumers > 0 ? config->max_consumers : MSU_AVLLQ_MAX_CONSUMER;
+
     assert(capacity >= MSU_AVLLQ_MIN_CAPACITY && max_item_size > 0);
 
     if (capacity < MSU_AVLLQ_MIN_CAPACITY || capacity > MSU_AVLLQ_MAX_CAPACITY) {
-        printf("Illegal msu_avllq capacity: %d\n", capacity);
+        printf("Illegal msu_avllq capacity: %u\n", capacity);
+        return NULL;
+    }
+
+    if (max_consumers > MSU_AVLLQ_MAX_CONSUMER_LIMIT) {
+        printf("Illegal msu_avllq max consumers: %d\n", max_consumers);
+        return NULL;
+    }
+
+    int producers = config->producers > 1 ? config->producers : 1;
+    if ((uint32_t)producers >= capacity || (producers > 1 && config->ring_bytes)) {
+        printf("Illegal msu_avllq producers: %d\n", config->producers);
+        return NULL;
+    }
+
+    if (config->lossless && (producers > 1 || config->ring_bytes)) {
+        printf("Lossless msu_avllq needs a single producer and buffer mode\n");
         return NULL;
     }
 
-    msu_avllq_handle_t q = (msu_avllq_handle_t)malloc(sizeof(struct msu_avllq_s));
+    if (config->ring_bytes && config->ring_bytes < (size_t)max_item_size) {
+        printf("Illegal msu_avllq ring bytes: %zu\n", config->ring_bytes);
+        return NULL;
+    }
+
+    msu_avllq_handle_t q = (msu_avllq_handle_t)msu_avllq_aligned_calloc(1, sizeof(struct msu_avllq_s));
     if (!q) {
         printf("Failed to alloc msu_avllq\n");
         return NULL;
     }
 
-    q->buf_array = (msu_avllq_item_t *)malloc(capacity * sizeof(msu_avllq_item_t));
-    if (!q->buf_array) {
-        free(q);
-        printf("Failed to alloc %d bufs in msu_avllq\n", capacity);
-        return NULL;
+    q->capacity = capacity;
+    q->capacity_mask = IS_POW2(capacity) ? capacity - 1 : 0;
+    q->max_item_size = max_item_size;
+    q->max_consumers = max_consumers;
+    q->map_words = (max_consumers + 63) / 64;
+    q->ring_bytes = config->ring_bytes;
+    q->ring_mask = q->ring_bytes && IS_POW2(q->ring_bytes) ? q->ring_bytes - 1 : 0;
+    q->keyframe_policy = config->keyframe_policy;
+    q->keyframe_type = config->keyframe_type;
+    q->track_latency = MSU_AVLLQ_LATENCY && config->track_latency;
+    q->producers = producers;
+    q->lossless = config->lossless;
+    q->all_bufs = NULL;
+    q->reserved_data = NULL;
+
+    atomic_init(&q->spare_bufs, NULL);
+    atomic_init(&q->wr_seq, 0);
+    atomic_init(&q->min_valid_pos, 0);
+    atomic_init(&q->key_seq, MSU_AVLLQ_INVALID_SEQ);
+    atomic_init(&q->key_buf, NULL);
+    atomic_init(&q->key_len, 0);
+    atomic_init(&q->rd_seq, 0);
+    atomic_init(&q->claim_seq, 0);
+    atomic_init(&q->publish_turn, 0);
+    atomic_init(&q->policy_consumers, 0);
+    atomic_init(&q->producer_waiting, 0);
+    atomic_init(&q->consumer_gen, 0);
+    q->slowest_seq = MSU_AVLLQ_INVALID_SEQ;
+    q->slowest_gen = 0;
+
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_mutex_init(&q->buf_mutex, NULL);
+
+    q->slots = (msu_avllq_slot_t *)msu_avllq_aligned_calloc(capacity, sizeof(msu_avllq_slot_t));
+    q->consumers = (msu_avllq_consumer_t *)msu_avllq_aligned_calloc(max_consumers, sizeof(msu_avllq_consumer_t));
+
+    /* before any failure path, destroy relies on the entries being free with no eventfd or pool */
+    if (q->consumers) {
+        for (int i = 0; i < max_consumers; i++) {
+            atomic_init(&q->consumers[i].id, -1);
+            atomic_init(&q->consumers[i].rd_seq, 0);
+            atomic_init(&q->consumers[i].waiting, 0);
+            atomic_init(&q->consumers[i].event_fd, -1);
+            atomic_init(&q->consumers[i].event_signaled, 0);
+            q->consumers[i].generation = 0;
+            q->consumers[i].need_sync = 0;
+            q->consumers[i].key_floor = 0;
+            q->consumers[i].overrun_floor = 0;
+            atomic_init(&q->consumers[i].stat_consumed, 0);
+            atomic_init(&q->consumers[i].stat_overrun, 0);
+            atomic_init(&q->consumers[i].stat_max_lag, 0);
+            atomic_init(&q->consumers[i].spill_count, 0);
+            q->consumers[i].spill_head = NULL;
+            q->consumers[i].spill_tail = NULL;
+            pthread_mutex_init(&q->consumers[i].spill_mutex, NULL);
+            q->consumers[i].pool = NULL;
+        }
     }
 
-    q->preserved_buf = (void *)malloc(capacity * sizeof(void *));
-    if (!q->preserved_buf) {
-        free(q);
-        printf("Failed to alloc preserved buf\n");
+    q->live_map = (_Atomic uint64_t *)calloc(q->map_words, sizeof(uint64_t));
+    q->notify_map = (_Atomic uint64_t *)calloc(q->map_words, sizeof(uint64_t));
+    if (!q->slots || !q->consumers || !q->live_map || !q->notify_map) {
+        msu_avllq_destroy(q);
+        printf("Failed to alloc %u slots and %d consumers in msu_avllq\n", capacity, max_consumers);
         return NULL;
     }
 
-    for (int i = 0; i < capacity; i++) {
-        q->preserved_buf[i] = malloc(max_item_size);
-        if (!q->preserved_buf[i]) {
-            free(q);
-            printf("Failed to allocate preserved_buf[%d]\n", i);
+    if (q->ring_bytes) {
+        void *ring = NULL;
+        if (config->use_slab ? msu_avllq_slab_alloc(q, q->ring_bytes) != 0 :
+                               posix_memalign(&ring, MSU_AVLLQ_BUF_ALIGN, q->ring_bytes) != 0) {
+            msu_avllq_destroy(q);
+            printf("Failed to allocate byte ring of %zu bytes\n", q->ring_bytes);
             return NULL;
         }
+
+        if (ring) {
+            q->slab = (uint8_t *)ring;
+        }
+
+        /* no per slot buffers */
+        return q;
     }
 
-    q->wr_off = 0;
-    q->rd_off = 0;
-    q->capacity = capacity;
-    q->consumer_id_seq_no = 0;
-    q->max_item_size = max_item_size;
+    if (config->use_slab && msu_avllq_slab_alloc(q, (size_t)capacity * BUF_STRIDE(q)) != 0) {
+        msu_avllq_destroy(q);
+        printf("Failed to allocate slab of %u preserved bufs\n", capacity);
+        return NULL;
+    }
 
-    memset(q->rd_off_local, 0, sizeof(q->rd_off_local));
-    memset(q->consumer, -1, sizeof(q->consumer));
+    for (uint32_t i = 0; i < capacity; i++) {
+        msu_avllq_buf_t *buf;
+        if (q->slab) {
+            buf = (msu_avllq_buf_t *)(q->slab + i * BUF_STRIDE(q));
+            atomic_init(&buf->ref_count, 1);
+            buf->next = NULL;
+            buf->all_next = NULL;
+        } else {
+            buf = msu_avllq_buf_alloc(q);
+        }
 
-    pthread_mutex_init(&q->mutex, NULL);
+        if (!buf) {
+            msu_avllq_destroy(q);
+            printf("Failed to allocate preserved buf %u\n", i);
+            return NULL;
+        }
+        atomic_init(&q->slots[i].buf, buf);
+    }
 
     return q;
 }
@@ -92,41 +489,181 @@ void msu_avllq_destroy(msu_avllq_handle_t q)
 {
     assert(q != NULL);
 
-    free(q->buf_array);
+    free(q->slots);
+
+    /* borrowed items must be returned before destroy */
+    msu_avllq_buf_t *buf = q->all_bufs;
+    while (buf) {
+        msu_avllq_buf_t *next = buf->all_next;
+        free(buf);
+        buf = next;
+    }
+
+    if (q->slab_mapped) {
+        munmap(q->slab, q->slab_size);
+    } else {
+        free(q->slab);
+    }
 
-    if (q->preserved_buf && q->max_item_size > 0) {
-        for (int i = 0; i < q->capacity; i++) {
-            free(q->preserved_buf[i]);
+    if (q->consumers) {
+        for (int i = 0; i < q->max_consumers; i++) {
+            int efd = atomic_load_explicit(&q->consumers[i].event_fd, memory_order_relaxed);
+            if (efd != -1) {
+                close(efd);
+            }
+            free(q->consumers[i].latency);
+            free(q->consumers[i].latency_base);
+            msu_avllq_drop_spilled(&q->consumers[i], MSU_AVLLQ_INVALID_SEQ);
+            pthread_mutex_destroy(&q->consumers[i].spill_mutex);
+            if (CONSUMER_EXISTS(q, i) && q->consumers[i].pool) {
+                msu_avllq_pool_close(q->consumers[i].pool);
+            }
         }
-        free(q->preserved_buf);
+        free(q->consumers);
     }
 
+    free(q->live_map);
+    free(q->notify_map);
+
     pthread_mutex_destroy(&q->mutex);
+    pthread_mutex_destroy(&q->buf_mutex);
 
     free(q);
 }
 
 int msu_avllq_register_consumer(msu_avllq_handle_t q)
+{
+    return msu_avllq_register_consumer2(q, NULL);
+}
+
+int msu_avllq_register_consumer2(msu_avllq_handle_t q, const msu_avllq_consumer_config_t *config)
 {
     assert(q != NULL);
 
+    int group = config ? config->group : 0;
+    msu_avllq_policy_t policy = config ? config->policy : MSU_AVLLQ_POLICY_DROP;
+    int consumer_id = -1;
+
+    if (group && (q->ring_bytes || q->keyframe_policy)) {
+        printf("Consumer groups need buffer mode without keyframe policy\n");
+        return -1;
+    }
+
+    if (policy != MSU_AVLLQ_POLICY_DROP &&
+        (q->producers > 1 || q->ring_bytes || q->keyframe_policy || (group && policy == MSU_AVLLQ_POLICY_SPILL))) {
+        printf("Consumer policy %d needs a single producer and buffer mode, no keyframe policy or group spill\n",
+               policy);
+        return -1;
+    }
+
+    if (config && !config->out_alloc != !config->out_free) {
+        printf("Consumer out_alloc and out_free must be set together\n");
+        return -1;
+    }
+
     pthread_mutex_lock(&q->mutex);
 
-    int consumer_id = q->consumer_id_seq_no++;
+    /* join the group if it has an entry already */
+    for (int w = 0; w < q->map_words && group && consumer_id == -1; w++) {
+        uint64_t bits = atomic_load_explicit(&q->live_map[w], memory_order_relaxed);
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            if (q->consumers[i].group == group) {
+                q->consumers[i].members++;
+                consumer_id = atomic_load_explicit(&q->consumers[i].id, memory_order_relaxed);
+                break;
+            }
+        }
+    }
+
+    for (int w = 0; w < q->map_words && consumer_id == -1; w++) {
+        uint64_t free_bits = ~atomic_load_explicit(&q->live_map[w], memory_order_relaxed);
+        if (!free_bits) {
+            continue;
+        }
+
+        int i = w * 64 + __builtin_ctzll(free_bits);
+        if (i >= q->max_consumers) {
+            break;
+        }
+
+        msu_avllq_consumer_t *c = &q->consumers[i];
 
-    int found_empty_slot = 0;
-    for (int i = 0; i < MSU_AVLLQ_MAX_CONSUMER; i++) {
-        if (q->consumer[i] == -1) {
-            q->consumer[i] = consumer_id;
-            q->rd_off_local[i] = q->rd_off;
-            found_empty_slot = 1;
+        /* the pool of the previous registration is closed, items still out keep it alive */
+        c->pool = msu_avllq_pool_create(q, config);
+        if (!c->pool) {
+            printf("Failed to alloc output buffer pool\n");
             break;
         }
+
+        /* like the eventfd, the histogram stays with the entry until destroy */
+        if (q->track_latency && !c->latency) {
+            c->latency = (_Atomic uint64_t *)malloc(LATENCY_BUCKETS * sizeof(uint64_t));
+            c->latency_base = (uint64_t *)malloc(LATENCY_BUCKETS * sizeof(uint64_t));
+            if (!c->latency || !c->latency_base) {
+                free(c->latency);
+                free(c->latency_base);
+                c->latency = NULL;
+                c->latency_base = NULL;
+                msu_avllq_pool_close(c->pool);
+                printf("Failed to alloc latency histogram\n");
+                break;
+            }
+        }
+
+        if (c->latency) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                atomic_store_explicit(&c->latency[b], 0, memory_order_relaxed);
+                c->latency_base[b] = 0;
+            }
+        }
+
+        c->generation = (c->generation + 1) & CONSUMER_GENERATION_MASK;
+        c->group = group;
+        c->members = 1;
+        c->policy = policy;
+        c->block_timeout_ns = config ? config->block_timeout_ns : 0;
+        c->spill_limit = config ? config->spill_limit : 0;
+        consumer_id = CONSUMER_ID(c->generation, i);
+
+        uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+        uint64_t rd_seq = msu_avllq_global_rd_seq(q, wr_seq);
+        c->overrun_floor = rd_seq;
+
+        /* start at the latest keyframe, the pinned one if it already dropped out of the window */
+        c->need_sync = q->keyframe_policy;
+        if (q->keyframe_policy) {
+            uint64_t key_seq = atomic_load_explicit(&q->key_seq, memory_order_acquire);
+            if (key_seq < rd_seq) {
+                rd_seq = key_seq;
+            }
+        }
+
+        c->key_floor = rd_seq;
+        atomic_store_explicit(&c->stat_consumed, 0, memory_order_relaxed);
+        atomic_store_explicit(&c->stat_overrun, 0, memory_order_relaxed);
+        atomic_store_explicit(&c->stat_max_lag, 0, memory_order_relaxed);
+
+        atomic_store_explicit(&c->rd_seq, rd_seq, memory_order_relaxed);
+        atomic_store_explicit(&c->id, consumer_id, memory_order_release);
+        atomic_fetch_or_explicit(&q->live_map[w], MAP_BIT(i), memory_order_release);
+
+        /* a keyframe consumer may start behind the slowest one, the lossless producer has to look again */
+        atomic_fetch_add_explicit(&q->consumer_gen, 1, memory_order_release);
+
+        if (policy != MSU_AVLLQ_POLICY_DROP) {
+            atomic_fetch_add_explicit(&q->policy_consumers, 1, memory_order_relaxed);
+        }
+
+        /* the eventfd outlives consumers of the entry, reset the readiness left by the previous one */
+        msu_avllq_event_sync(q, i);
     }
 
     pthread_mutex_unlock(&q->mutex);
 
-    return found_empty_slot ? consumer_id : -1;
+    return consumer_id;
 }
 
 void msu_avllq_deregister_consumer(msu_avllq_handle_t q, int consumer_id)
@@ -136,17 +673,33 @@ void msu_avllq_deregister_consumer(msu_avllq_handle_t q, int consumer_id)
 
     pthread_mutex_lock(&q->mutex);
 
-    for (int i = 0; i < MSU_AVLLQ_MAX_CONSUMER; i++) {
-        if (q->consumer[i] == consumer_id) {
-            q->consumer[i] = -1;
-            break;
+    int i = msu_avllq_find_consumer_index(q, consumer_id);
+    if (i != -1 && --q->consumers[i].members == 0) {
+        /* keep what the leaving consumer has read, the global read seq must not go back */
+        uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+        msu_avllq_advance_global_rd_seq(q, msu_avllq_global_rd_seq(q, wr_seq));
+
+        msu_avllq_consumer_t *c = &q->consumers[i];
+
+        atomic_fetch_and_explicit(&q->live_map[MAP_WORD(i)], ~MAP_BIT(i), memory_order_release);
+        atomic_store_explicit(&c->id, -1, memory_order_release);
+        msu_avllq_pool_close(c->pool);
+
+        if (c->policy != MSU_AVLLQ_POLICY_DROP) {
+            atomic_fetch_sub_explicit(&q->policy_consumers, 1, memory_order_relaxed);
+
+            /* the producer may be waiting for this consumer, or spilling for it */
+            msu_avllq_wake_producer(q);
+            pthread_mutex_lock(&c->spill_mutex);
+            msu_avllq_drop_spilled(c, MSU_AVLLQ_INVALID_SEQ);
+            pthread_mutex_unlock(&c->spill_mutex);
         }
     }
 
     pthread_mutex_unlock(&q->mutex);
 }
 
-int msu_avllq_enumerate_consumers(msu_avllq_handle_t q, int consumer[MSU_AVLLQ_MAX_CONSUMER])
+int msu_avllq_enumerate_consumers(msu_avllq_handle_t q, int consumer[])
 {
     assert(q != NULL);
 
@@ -154,9 +707,12 @@ int msu_avllq_enumerate_consumers(msu_avllq_handle_t q, int consumer[MSU_AVLLQ_M
 
     pthread_mutex_lock(&q->mutex);
 
-    for (int i = 0; i < MSU_AVLLQ_MAX_CONSUMER; i++) {
-        if (q->consumer[i] != -1) {
-            consumer[count++] = q->consumer[i];
+    for (int w = 0; w < q->map_words; w++) {
+        uint64_t bits = atomic_load_explicit(&q->live_map[w], memory_order_relaxed);
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            consumer[count++] = atomic_load_explicit(&q->consumers[i].id, memory_order_relaxed);
         }
     }
 
@@ -173,270 +729,2394 @@ msu_avllq_status_t msu_avllq_produce(msu_avllq_handle_t q, const msu_avllq_item_
     return msu_avllq_produce2(q, item->data, item->len, item->type);
 }
 
+/*
+ * single producer mode only blocks for consumers registered with MSU_AVLLQ_POLICY_BLOCK, multiple
+ * producers only wait for each other
+ */
 msu_avllq_status_t msu_avllq_produce2(msu_avllq_handle_t q, const void *data, size_t len, int type)
 {
     assert(q != NULL);
     assert(data != NULL);
     assert(len > 0);
 
-    void *new_data = NULL;
+    if (q->producers > 1) {
+        struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+        return msu_avllq_producev(q, &iov, 1, type);
+    }
 
-    pthread_mutex_lock(&q->mutex);
+    msu_avllq_status_t room = msu_avllq_make_room(q);
+    if (room != MSU_AVLLQ_STATUS_OK && room != MSU_AVLLQ_STATUS_SPILLED) {
+        return room;
+    }
+
+    void *dst = msu_avllq_reserve_slot(q, len);
+    if (!dst) {
+        return len > (size_t)q->max_item_size ? MSU_AVLLQ_STATUS_ERR : MSU_AVLLQ_STATUS_MEMORY_ERR;
+    }
 
-    new_data = q->preserved_buf[q->wr_off];
+    memcpy(dst, data, len);
 
-    /* enqueue */
-    q->buf_array[q->wr_off].data = new_data;
-    memcpy(q->buf_array[q->wr_off].data, data, len);
-    q->buf_array[q->wr_off].len = len;
-    q->buf_array[q->wr_off].type = type;
+    msu_avllq_status_t status = msu_avllq_commit(q, len, type);
 
-    /* update write ptr */
-    ADVANCE_WR_OFF(q);
+    return status == MSU_AVLLQ_STATUS_OK ? room : status;
+}
 
-    /*
-     * update write ptr may lead to equal write and read ptr, which means the queue is empty,
-     * so we need to update read ptr accordingly. In this case, consumer will miss a buffer
-     */
-    if (q->rd_off == q->wr_off) {
-        ADVANCE_GLOBAL_RD_OFFSET(q);
+/* gathers the buffers straight into the slot */
+msu_avllq_status_t msu_avllq_producev(msu_avllq_handle_t q, const struct iovec *iov, int iovcnt, int type)
+{
+    assert(q != NULL);
+    assert(iov != NULL && iovcnt > 0);
+
+    /* checked per buffer, a sum past SIZE_MAX would wrap to a small len and overrun the slot */
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t)q->max_item_size - len) {
+            printf("Illegal item size, more than max item size %d\n", q->max_item_size);
+            return MSU_AVLLQ_STATUS_ERR;
+        }
+        len += iov[i].iov_len;
+    }
+
+    if (len == 0) {
+        printf("Illegal item size %zu, max item size %d\n", len, q->max_item_size);
+        return MSU_AVLLQ_STATUS_ERR;
     }
 
-    /* update local read ptr as well */
-    for (int i = 0; i < MSU_AVLLQ_MAX_CONSUMER; i++) {
-        if (q->consumer[i] != -1 && q->rd_off_local[i] == q->wr_off) {
-            ADVANCE_LOCAL_RD_OFFSET(q, i);
+    msu_avllq_status_t room = MSU_AVLLQ_STATUS_OK;
+    uint64_t ticket = 0;
+    uint8_t *dst;
+
+    if (q->producers > 1) {
+        ticket = atomic_fetch_add_explicit(&q->claim_seq, 1, memory_order_relaxed);
+        dst = msu_avllq_mp_claim(q, ticket);
+        if (!dst) {
+            msu_avllq_mp_publish(q, ticket, 0, 0);
         }
+    } else {
+        room = msu_avllq_make_room(q);
+        if (room != MSU_AVLLQ_STATUS_OK && room != MSU_AVLLQ_STATUS_SPILLED) {
+            return room;
+        }
+        dst = (uint8_t *)msu_avllq_reserve_slot(q, len);
     }
 
-    pthread_mutex_unlock(&q->mutex);
+    if (!dst) {
+        return MSU_AVLLQ_STATUS_MEMORY_ERR;
+    }
 
-    return MSU_AVLLQ_STATUS_OK;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+
+    if (q->producers > 1) {
+        msu_avllq_mp_publish(q, ticket, len, type);
+        msu_avllq_wake_consumers(q);
+        return MSU_AVLLQ_STATUS_OK;
+    }
+
+    msu_avllq_status_t status = msu_avllq_commit(q, len, type);
+
+    return status == MSU_AVLLQ_STATUS_OK ? room : status;
 }
 
-msu_avllq_status_t msu_avllq_consume(msu_avllq_handle_t q, int consumer_id, msu_avllq_item_t *item)
+void *msu_avllq_reserve(msu_avllq_handle_t q, size_t len)
 {
     assert(q != NULL);
-    assert(consumer_id != -1);
-    assert(item != NULL);
-
-    pthread_mutex_lock(&q->mutex);
-
-    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
 
-    if (consumer_index == -1) {
-        printf("Consumer %d not registered", consumer_id);
-        pthread_mutex_unlock(&q->mutex);
-        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    if (q->producers > 1) {
+        printf("Reserve is not supported with multiple producers\n");
+        return NULL;
     }
 
-    if (MSU_AVLLQ_IS_LOCAL_EMPTY(q, consumer_index)) {
-        printf("Empty queue for consumer_index: %d\n", consumer_index);
-        pthread_mutex_unlock(&q->mutex);
-        return MSU_AVLLQ_STATUS_NO_BUF;
+    /* reserve again without commit, room has been made already */
+    if (!q->reserved_data) {
+        msu_avllq_status_t room = msu_avllq_make_room(q);
+        if (room != MSU_AVLLQ_STATUS_OK && room != MSU_AVLLQ_STATUS_SPILLED) {
+            return NULL;
+        }
     }
 
-    uint8_t rd_off_local = q->rd_off_local[consumer_index];
+    return msu_avllq_reserve_slot(q, len);
+}
 
-    void *out_data = malloc(q->buf_array[rd_off_local].len);
-    if (!out_data) {
-        printf("Failed to alloc memory for output consume data\n");
-        pthread_mutex_unlock(&q->mutex);
-        return MSU_AVLLQ_STATUS_MEMORY_ERR;
+/* single producer, the buffer of the next item */
+static void *msu_avllq_reserve_slot(msu_avllq_handle_t q, size_t len)
+{
+    if (len > (size_t)q->max_item_size) {
+        printf("Item size %zu exceeds max item size %d\n", len, q->max_item_size);
+        return NULL;
     }
 
-    item->type = q->buf_array[rd_off_local].type;
-    item->len = q->buf_array[rd_off_local].len;
-    item->data = out_data;
-    memcpy(item->data, q->buf_array[rd_off_local].data, item->len);
-
-    ADVANCE_LOCAL_RD_OFFSET(q, consumer_index);
-
-    /* calculate the number of local read ptrs which are faster than global read ptr */
-    int consumer_count = 0;
-    int fast_consumer_count = 0;
-    for (int i = 0; i < MSU_AVLLQ_MAX_CONSUMER; i++) {
-        if (q->consumer[i] != -1) {
-            consumer_count++;
-            if (msu_avllq_compare_read_speed2(q, i) < 0) {
-                fast_consumer_count++;
-            }
-        }
+    /* reserve again without commit, hand out the same buffer */
+    if (q->reserved_data && (!q->ring_bytes || len <= q->reserved_len)) {
+        return q->reserved_data;
     }
 
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_relaxed);
+    msu_avllq_slot_t *slot = &q->slots[SLOT_INDEX(q, wr_seq)];
+
     /*
-     * if all local read ptr is faster than global read ptr,
-     * update global read ptr to the read ptr of the slowest consumer
+     * the slot holds an item which already dropped out of the readable window, mark it as being
+     * written so that a consumer still copying or borrowing the old item notices it and retries.
      */
-    if (fast_consumer_count == consumer_count && fast_consumer_count > 0) {
-        q->rd_off = msu_avllq_slowest_rd_off(q);
+    atomic_store_explicit(&slot->seq, SEQLOCK_WRITING(wr_seq), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
 
-        if (q->rd_off == MSU_AVLLQ_INVALID_OFF) {
-            printf("Invalid offset, should not happen if consumer registered\n");
-        }
+    if (q->ring_bytes) {
+        q->reserved_data = msu_avllq_ring_reserve(q, len);
+        q->reserved_len = len;
+        return q->reserved_data;
     }
 
-    pthread_mutex_unlock(&q->mutex);
+    msu_avllq_buf_t *buf = msu_avllq_writable_buf(q, slot);
+    if (!buf) {
+        /* slot is left unpublished, it is out of the window anyway */
+        printf("Failed to alloc spare buf\n");
+        return NULL;
+    }
 
-    return MSU_AVLLQ_STATUS_OK;
+    q->reserved_data = buf->data;
+    q->reserved_len = q->max_item_size;
+
+    return buf->data;
 }
 
-void msu_avllq_item_release(msu_avllq_item_t const* item)
+/*
+ * lossless, the next item would overwrite one the slowest consumer has not read yet. Read seqs only move
+ * forward and only a registration can start behind the slowest consumer, so the last scan stays a lower
+ * bound until consumer_gen changes. The consumers are only scanned again when that bound says full.
+ */
+static int msu_avllq_lossless_full(msu_avllq_handle_t q)
 {
-    assert(item != NULL);
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_relaxed);
+    uint64_t gen = atomic_load_explicit(&q->consumer_gen, memory_order_acquire);
+
+    if (gen == q->slowest_gen &&
+        (q->slowest_seq == MSU_AVLLQ_INVALID_SEQ || wr_seq - q->slowest_seq < MSU_AVLLQ_WINDOW(q))) {
+        return 0;
+    }
 
-    free(item->data);
+    q->slowest_seq = msu_avllq_slowest_rd_seq2(q, wr_seq);
+    q->slowest_gen = gen;
+
+    return q->slowest_seq != MSU_AVLLQ_INVALID_SEQ && wr_seq - q->slowest_seq >= MSU_AVLLQ_WINDOW(q);
 }
 
-/* should be called inside lock */
-static int msu_avllq_find_consumer_index(msu_avllq_handle_t q, int consumer_id)
+/*
+ * single producer, before the next item: fail if a lossless queue is full, then let the consumers with a policy
+ * have the item which drops out of the window. Blocking consumers go first, so nothing is spilled for an item
+ * which is not produced in the end. The policies cost one load when no consumer has one.
+ */
+static msu_avllq_status_t msu_avllq_make_room(msu_avllq_handle_t q)
 {
-    int idx;
-    for (idx = 0; idx < MSU_AVLLQ_MAX_CONSUMER; idx++) {
-        if (q->consumer[idx] == consumer_id)
-            break;
+    if (q->lossless && msu_avllq_lossless_full(q)) {
+        return MSU_AVLLQ_STATUS_NO_BUF;
     }
 
-    if (idx == MSU_AVLLQ_MAX_CONSUMER) {
-        printf("No consumer_id %d found\n", consumer_id);
-        idx = -1;
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_relaxed);
+    if (!atomic_load_explicit(&q->policy_consumers, memory_order_relaxed) || wr_seq < MSU_AVLLQ_WINDOW(q)) {
+        return MSU_AVLLQ_STATUS_OK;
     }
 
-    return idx;
+    uint64_t evict = wr_seq - MSU_AVLLQ_WINDOW(q);
+    msu_avllq_status_t status = MSU_AVLLQ_STATUS_OK;
+
+    /* all blocking consumers count their timeout from one start, the producer stalls for the longest at most */
+    struct timespec start;
+    int started = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int w = 0; w < q->map_words; w++) {
+            uint64_t bits = atomic_load_explicit(&q->live_map[w], memory_order_acquire);
+            while (bits) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                msu_avllq_consumer_t *c = &q->consumers[i];
+                bits &= bits - 1;
+
+                if (pass == 0 && c->policy == MSU_AVLLQ_POLICY_BLOCK &&
+                    atomic_load_explicit(&c->rd_seq, memory_order_acquire) <= evict) {
+                    if (!started) {
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+                        started = 1;
+                    }
+
+                    if (msu_avllq_block_wait(q, i, evict, &start) != 0) {
+                        return MSU_AVLLQ_STATUS_TIMEOUT;
+                    }
+                }
+
+                if (pass == 1 && c->policy == MSU_AVLLQ_POLICY_SPILL &&
+                    atomic_load_explicit(&c->rd_seq, memory_order_acquire) <= evict &&
+                    msu_avllq_spill(q, i, evict) == 0) {
+                    status = MSU_AVLLQ_STATUS_SPILLED;
+                }
+            }
+        }
+    }
+
+    return status;
 }
 
 /*
- * compare the speed of global read offset and the read offset of a consumer.
- * return <0, global is slow; =0, equal; >0, global is faster
+ * block policy, wait until the consumer has read seq or leaves, -1 once its timeout has passed since start.
+ * A timeout of 0 does not wait at all. producer_waiting is only
+ * raised right before sleeping and dropped again on return, so a consumer which keeps up never sees it
+ * and never pays for a wake.
  */
-static int msu_avllq_compare_read_speed2(msu_avllq_handle_t q, int consumer_index)
+static int msu_avllq_block_wait(msu_avllq_handle_t q, int consumer_index, uint64_t seq, const struct timespec *start)
 {
-    assert(CONSUMER_EXISTS(q, consumer_index));
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    int consumer_id = atomic_load_explicit(&c->id, memory_order_acquire);
 
-    if (q->rd_off == q->rd_off_local[consumer_index]) {
+    if (atomic_load_explicit(&c->rd_seq, memory_order_acquire) > seq) {
         return 0;
     }
 
-    int diff1 = (int)q->rd_off - (int)q->wr_off;
-    int diff2 = (int)q->rd_off_local[consumer_index] - (int)q->wr_off;
+    int64_t timeout_ns = c->block_timeout_ns;
+    struct timespec deadline = *start;
 
-    if (diff1 == 0) {
-        if (diff2 != 0) {
-            /*
-             * Queue empty, but local read ptr is not pointing to wr_off, should not happen.
-             * According to definition, global read ptr is slowest, it can only advance after
-             * all global read has completed.
-             */
-            printf("Whole ring buffer is empty, but local read pointer is ahead, not allowed!\n");
-        }
-
-        return 0;
-    }
-
-    /*
-     * Unread buffer exists globally，but local read ptr and global write ptr is equal,
-     * which means that the consumer has completed fetching buffer, global is slower.
-     */
-    if (diff2 == 0) {
-        return -1;
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec += timeout_ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
     }
 
-    /* Now, mul is either 1 or -1 */
-    int mul = diff1 * diff2;
+    for (;;) {
+        /* pairs with the fence in msu_avllq_wake_producer(), either the consumer sees the flag or we its read seq */
+        atomic_store_explicit(&q->producer_waiting, 1, memory_order_seq_cst);
 
-    /*
-     * the natual growing direction is to the right, so:
-     * mul < 0, wr_off in the middle, left is faster; mul > 0, in the same side of wr_off, right is faster
-     */
-    return mul * ( (int)q->rd_off - (int)q->rd_off_local[consumer_index] );
-}
+        if (atomic_load_explicit(&c->id, memory_order_seq_cst) != consumer_id ||
+            atomic_load_explicit(&c->rd_seq, memory_order_seq_cst) > seq) {
+            atomic_store_explicit(&q->producer_waiting, 0, memory_order_relaxed);
+            return 0;
+        }
 
-int msu_avllq_buf_size(msu_avllq_handle_t q)
-{
-    assert(q != NULL);
+        struct timespec *timeout = NULL;
+        struct timespec remaining;
 
-    pthread_mutex_lock(&q->mutex);
-    int sz = MSU_AVLLQ_BUF_SIZE(q);
-    pthread_mutex_unlock(&q->mutex);
+        if (timeout_ns >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return sz;
-}
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000;
+            }
 
-int msu_avllq_buf_empty(msu_avllq_handle_t q)
-{
-    assert(q != NULL);
+            if (remaining.tv_sec < 0) {
+                atomic_store_explicit(&q->producer_waiting, 0, memory_order_relaxed);
+                return -1;
+            }
 
-    pthread_mutex_lock(&q->mutex);
-    int empty = MSU_AVLLQ_IS_GLOBAL_EMPTY(q);
-    pthread_mutex_unlock(&q->mutex);
+            timeout = &remaining;
+        }
 
-    return empty;
+        if (syscall(SYS_futex, (uint32_t *)&q->producer_waiting, FUTEX_WAIT_PRIVATE, 1,
+                    timeout, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            printf("futex wait failed: %s\n", strerror(errno));
+            atomic_store_explicit(&q->producer_waiting, 0, memory_order_relaxed);
+            return -1;
+        }
+    }
 }
 
-int msu_avllq_buf_full(msu_avllq_handle_t q)
+/* consumer side, a blocking consumer has moved its read seq */
+static void msu_avllq_wake_producer(msu_avllq_handle_t q)
 {
-    assert(q != NULL);
-
-    pthread_mutex_lock(&q->mutex);
-    int full = MSU_AVLLQ_IS_GLOBAL_FULL(q);
-    pthread_mutex_unlock(&q->mutex);
+    atomic_thread_fence(memory_order_seq_cst);
 
-    return full;
+    if (atomic_load_explicit(&q->producer_waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(&q->producer_waiting, 0, memory_order_relaxed)) {
+        syscall(SYS_futex, (uint32_t *)&q->producer_waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
-int msu_avllq_local_buf_empty(msu_avllq_handle_t q, int consumer_id)
+/*
+ * spill policy, producer only: copy item seq, which is about to drop out of the window, to the spill list of
+ * the consumer. -1 if the list is full or on allocation failure, the consumer counts the item as overrun.
+ */
+static int msu_avllq_spill(msu_avllq_handle_t q, int consumer_index, uint64_t seq)
 {
-    assert(q != NULL);
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    msu_avllq_slot_t *slot = &q->slots[SLOT_INDEX(q, seq)];
 
-    int idx = msu_avllq_find_consumer_index(q, consumer_id);
+    if (c->spill_limit && atomic_load_explicit(&c->spill_count, memory_order_relaxed) >= c->spill_limit) {
+        return -1;
+    }
 
-    return MSU_AVLLQ_IS_LOCAL_EMPTY(q, idx);
-}
+    /* not from the pool of the consumer, the producer must not pop its free list */
+    size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+    msu_avllq_spill_t *spill = (msu_avllq_spill_t *)malloc(sizeof(msu_avllq_spill_t));
+    msu_avllq_out_t *out = (msu_avllq_out_t *)malloc(sizeof(msu_avllq_out_t) + len);
+    if (!spill || !out) {
+        free(spill);
+        free(out);
+        printf("Failed to alloc spilled item\n");
+        return -1;
+    }
 
-int msu_avllq_local_buf_full(msu_avllq_handle_t q, int consumer_id)
-{
-    assert(q != NULL);
+    out->pool = NULL;
+    void *data = out->data;
+    memcpy(data, atomic_load_explicit(&slot->buf, memory_order_relaxed)->data, len);
+    spill->next = NULL;
+    spill->seq = seq;
+    spill->len = len;
+    spill->type = atomic_load_explicit(&slot->type, memory_order_relaxed);
+    spill->stamp = LATENCY_STAMP(slot);
+    spill->data = data;
+
+    pthread_mutex_lock(&c->spill_mutex);
+
+    /* the consumer may have left since the policy was checked */
+    if (!CONSUMER_EXISTS(q, consumer_index) || c->policy != MSU_AVLLQ_POLICY_SPILL) {
+        pthread_mutex_unlock(&c->spill_mutex);
+        msu_avllq_out_free(data);
+        free(spill);
+        return -1;
+    }
 
-    int idx = msu_avllq_find_consumer_index(q, consumer_id);
+    if (c->spill_tail) {
+        c->spill_tail->next = spill;
+    } else {
+        c->spill_head = spill;
+    }
+    c->spill_tail = spill;
+    atomic_fetch_add_explicit(&c->spill_count, 1, memory_order_relaxed);
+
+    pthread_mutex_unlock(&c->spill_mutex);
 
-    return MSU_AVLLQ_IS_LOCAL_FULL(q, idx);
+    return 0;
 }
 
-int msu_avllq_compare_read_speed(msu_avllq_handle_t q, int consumer_id)
+/*
+ * spill policy, consumer side: a cursor which fell out of the window continues with the spilled items. Items
+ * the consumer has read from the queue before they were spilled are dropped. NO_BUF if there is none to take.
+ */
+static msu_avllq_status_t msu_avllq_take_spilled(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor,
+                                                 msu_avllq_item_t *item)
 {
-    assert(q != NULL);
+    /* items are spilled before the write seq moves on, they are on the list by the time the cursor is behind */
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
 
-    int idx = msu_avllq_find_consumer_index(q, consumer_id);
+    if (!atomic_load_explicit(&c->spill_count, memory_order_relaxed)) {
+        return MSU_AVLLQ_STATUS_NO_BUF;
+    }
+
+    pthread_mutex_lock(&c->spill_mutex);
+
+    msu_avllq_drop_spilled(c, *cursor);
+
+    msu_avllq_spill_t *spill = c->spill_head;
+    if (!spill || *cursor >= MSU_AVLLQ_OLDEST_SEQ(q, wr_seq)) {
+        pthread_mutex_unlock(&c->spill_mutex);
+        return MSU_AVLLQ_STATUS_NO_BUF;
+    }
+
+    c->spill_head = spill->next;
+    if (!c->spill_head) {
+        c->spill_tail = NULL;
+    }
+    atomic_fetch_sub_explicit(&c->spill_count, 1, memory_order_relaxed);
+
+    pthread_mutex_unlock(&c->spill_mutex);
+
+    /* items not spilled, the list was full */
+    if (spill->seq > *cursor) {
+        STAT_ADD(c->stat_overrun, spill->seq - *cursor);
+    }
+
+    item->type = spill->type;
+    item->len = spill->len;
+    item->data = spill->data;
+
+    msu_avllq_account(q, c, spill->seq);
+    LATENCY_RECORD(q, c, spill->stamp);
+    *cursor = spill->seq + 1;
+
+    free(spill);
+
+    return MSU_AVLLQ_STATUS_OK;
+}
+
+/* spill policy, free the spilled items before seq. Called with spill_mutex held, or on destroy */
+static void msu_avllq_drop_spilled(msu_avllq_consumer_t *c, uint64_t seq)
+{
+    while (c->spill_head && c->spill_head->seq < seq) {
+        msu_avllq_spill_t *spill = c->spill_head;
+
+        c->spill_head = spill->next;
+        atomic_fetch_sub_explicit(&c->spill_count, 1, memory_order_relaxed);
+        msu_avllq_out_free(spill->data);
+        free(spill);
+    }
+
+    if (!c->spill_head) {
+        c->spill_tail = NULL;
+    }
+}
+
+msu_avllq_status_t msu_avllq_commit(msu_avllq_handle_t q, size_t len, int type)
+{
+    assert(q != NULL);
+    assert(len > 0);
+
+    if (!q->reserved_data) {
+        printf("Commit without reserve\n");
+        return MSU_AVLLQ_STATUS_ERR;
+    }
+
+    if (len > q->reserved_len) {
+        printf("Item size %zu exceeds reserved size %zu\n", len, q->reserved_len);
+        return MSU_AVLLQ_STATUS_ERR;
+    }
+
+    msu_avllq_publish(q, len, type);
+    msu_avllq_wake_consumers(q);
+
+    return MSU_AVLLQ_STATUS_OK;
+}
+
+/*
+ * All items are published before the consumers are woken up once, a consumer parked on the queue sees
+ * the whole batch in one go. Multiple producers claim the tickets of the batch at once, so it stays in order.
+ */
+msu_avllq_status_t msu_avllq_produce_n(msu_avllq_handle_t q, const msu_avllq_item_t *items, size_t n)
+{
+    assert(q != NULL);
+    assert(items != NULL || n == 0);
+
+    msu_avllq_status_t status = MSU_AVLLQ_STATUS_OK;
+    size_t i;
+
+    if (q->producers > 1) {
+        size_t valid = 0;
+        while (valid < n && ITEM_VALID(q, &items[valid])) {
+            valid++;
+        }
+
+        uint64_t ticket = atomic_fetch_add_explicit(&q->claim_seq, valid, memory_order_relaxed);
+
+        for (i = 0; i < valid; i++) {
+            uint8_t *dst = status == MSU_AVLLQ_STATUS_OK ? msu_avllq_mp_claim(q, ticket + i) : NULL;
+            if (!dst) {
+                /* the tickets are claimed, give the rest up so that later producers can publish */
+                status = MSU_AVLLQ_STATUS_MEMORY_ERR;
+                msu_avllq_mp_publish(q, ticket + i, 0, 0);
+                continue;
+            }
+
+            memcpy(dst, items[i].data, items[i].len);
+            msu_avllq_mp_publish(q, ticket + i, items[i].len, items[i].type);
+        }
+
+        if (valid > 0) {
+            msu_avllq_wake_consumers(q);
+        }
+
+        return valid < n && status == MSU_AVLLQ_STATUS_OK ? MSU_AVLLQ_STATUS_ERR : status;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!ITEM_VALID(q, &items[i])) {
+            status = MSU_AVLLQ_STATUS_ERR;
+            break;
+        }
+
+        msu_avllq_status_t room = msu_avllq_make_room(q);
+        if (room == MSU_AVLLQ_STATUS_SPILLED) {
+            status = room;
+        } else if (room != MSU_AVLLQ_STATUS_OK) {
+            status = room;
+            break;
+        }
+
+        void *dst = msu_avllq_reserve_slot(q, items[i].len);
+        if (!dst) {
+            status = MSU_AVLLQ_STATUS_MEMORY_ERR;
+            break;
+        }
+
+        memcpy(dst, items[i].data, items[i].len);
+        msu_avllq_publish(q, items[i].len, items[i].type);
+    }
+
+    if (i > 0) {
+        msu_avllq_wake_consumers(q);
+    }
+
+    return status;
+}
+
+/* one consumer id must not be consumed by multiple threads at the same time, except the id of a consumer group */
+msu_avllq_status_t msu_avllq_consume(msu_avllq_handle_t q, int consumer_id, msu_avllq_item_t *item)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+    assert(item != NULL);
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+
+    if (consumer_index == -1) {
+        printf("Consumer %d not registered", consumer_id);
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    if (q->consumers[consumer_index].group) {
+        return msu_avllq_group_consume(q, consumer_index, item, NULL, SIZE_MAX);
+    }
+
+    uint64_t cursor = msu_avllq_cursor(q, consumer_index);
+    msu_avllq_status_t status = msu_avllq_copy_next(q, &q->consumers[consumer_index], &cursor, item, NULL, SIZE_MAX);
+
+    /* even without an item, keep the items overrun or skipped while waiting for a keyframe */
+    msu_avllq_consumed(q, consumer_index, cursor);
+
+    return status;
+}
+
+/*
+ * jump over everything but the newest item. *skipped is the number of items passed over, including the
+ * ones already overwritten by the producer.
+ */
+msu_avllq_status_t msu_avllq_consume_latest(msu_avllq_handle_t q, int consumer_id, msu_avllq_item_t *item,
+                                            uint64_t *skipped)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+    assert(item != NULL);
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+
+    if (consumer_index == -1) {
+        printf("Consumer %d not registered", consumer_id);
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    if (c->group) {
+        printf("Consume latest is not supported by consumer groups\n");
+        return MSU_AVLLQ_STATUS_ERR;
+    }
+
+    uint64_t cursor = msu_avllq_cursor(q, consumer_index);
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+    uint64_t from = cursor;
+
+    msu_avllq_catch_up(q, c, &cursor, wr_seq);
+    if (wr_seq > cursor + 1) {
+        cursor = wr_seq - 1;
+    }
+
+    msu_avllq_status_t status = msu_avllq_copy_next(q, c, &cursor, item, NULL, SIZE_MAX);
+
+    msu_avllq_consumed(q, consumer_index, cursor);
+
+    if (skipped) {
+        *skipped = status == MSU_AVLLQ_STATUS_OK ? cursor - 1 - from : 0;
+    }
+
+    return status;
+}
+
+/*
+ * consume up to max items in one go, the local read seq is stored once for the whole batch. Returns
+ * MSU_AVLLQ_STATUS_NO_BUF only if nothing is consumed, *count tells how many items are filled in.
+ */
+msu_avllq_status_t msu_avllq_consume_n(msu_avllq_handle_t q, int consumer_id, msu_avllq_item_t *items,
+                                       size_t max, size_t *count)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+    assert(items != NULL || max == 0);
+    assert(count != NULL);
+
+    *count = 0;
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+
+    if (consumer_index == -1) {
+        printf("Consumer %d not registered", consumer_id);
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    msu_avllq_status_t status = MSU_AVLLQ_STATUS_OK;
+
+    /* group members claim item by item, other members take their share in between */
+    if (q->consumers[consumer_index].group) {
+        while (*count < max) {
+            status = msu_avllq_group_consume(q, consumer_index, &items[*count], NULL, SIZE_MAX);
+            if (status != MSU_AVLLQ_STATUS_OK) {
+                break;
+            }
+            (*count)++;
+        }
+
+        return *count > 0 && status == MSU_AVLLQ_STATUS_NO_BUF ? MSU_AVLLQ_STATUS_OK : status;
+    }
+
+    uint64_t cursor = msu_avllq_cursor(q, consumer_index);
+
+    while (*count < max) {
+        status = msu_avllq_copy_next(q, &q->consumers[consumer_index], &cursor, &items[*count], NULL, SIZE_MAX);
+        if (status != MSU_AVLLQ_STATUS_OK) {
+            break;
+        }
+        (*count)++;
+    }
+
+    msu_avllq_consumed(q, consumer_index, cursor);
+
+    if (*count > 0 && status == MSU_AVLLQ_STATUS_NO_BUF) {
+        return MSU_AVLLQ_STATUS_OK;
+    }
+
+    return status;
+}
+
+/* one copy, straight from the queue memory to the buffer of the caller */
+msu_avllq_status_t msu_avllq_consume_into(msu_avllq_handle_t q, int consumer_id, void *dst, size_t cap, size_t *len,
+                                          int *type)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+    assert(dst != NULL);
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+
+    if (consumer_index == -1) {
+        printf("Consumer %d not registered", consumer_id);
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    msu_avllq_item_t item;
+    msu_avllq_status_t status;
+
+    if (q->consumers[consumer_index].group) {
+        status = msu_avllq_group_consume(q, consumer_index, &item, dst, cap);
+    } else {
+        uint64_t cursor = msu_avllq_cursor(q, consumer_index);
+        status = msu_avllq_copy_next(q, &q->consumers[consumer_index], &cursor, &item, dst, cap);
+        msu_avllq_consumed(q, consumer_index, cursor);
+    }
+
+    if (status != MSU_AVLLQ_STATUS_OK) {
+        return status;
+    }
+
+    if (len) {
+        *len = item.len;
+    }
+    if (type) {
+        *type = item.type;
+    }
+
+    return item.len > cap ? MSU_AVLLQ_STATUS_TRUNCATED : MSU_AVLLQ_STATUS_OK;
+}
+
+/*
+ * copy out the next item after cursor and move cursor past it. The data goes to dst if given, at most cap bytes
+ * of it, item->len is the full length. Otherwise cap is SIZE_MAX and the data goes to a buffer of the pool.
+ */
+static msu_avllq_status_t msu_avllq_copy_next(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor,
+                                              msu_avllq_item_t *item, void *dst, size_t cap)
+{
+    for (;;) {
+        if (q->keyframe_policy) {
+            *cursor = msu_avllq_keyframe_sync(q, c, *cursor);
+
+            size_t key_len;
+            msu_avllq_buf_t *key_buf = msu_avllq_pinned_keyframe(q, c, &key_len);
+            if (key_buf) {
+                item->data = msu_avllq_out_get(c, dst, key_len);
+                if (!item->data) {
+                    msu_avllq_buf_unref(q, key_buf);
+                    printf("Failed to alloc memory for output consume data\n");
+                    return MSU_AVLLQ_STATUS_MEMORY_ERR;
+                }
+
+                memcpy(item->data, key_buf->data, key_len < cap ? key_len : cap);
+                msu_avllq_buf_unref(q, key_buf);
+
+                item->type = q->keyframe_type;
+                item->len = key_len;
+                msu_avllq_account(q, c, *cursor);
+                return MSU_AVLLQ_STATUS_OK;
+            }
+        }
+
+        if (c->policy == MSU_AVLLQ_POLICY_SPILL) {
+            msu_avllq_status_t status = msu_avllq_take_spilled(q, c, cursor, item);
+            if (status != MSU_AVLLQ_STATUS_NO_BUF) {
+                /* the spilled copy is handed out as is, unless the caller has a buffer */
+                if (status == MSU_AVLLQ_STATUS_OK && dst) {
+                    memcpy(dst, item->data, item->len < cap ? item->len : cap);
+                    msu_avllq_out_free(item->data);
+                    item->data = dst;
+                }
+                return status;
+            }
+        }
+
+        uint64_t rd_seq, seq;
+        msu_avllq_slot_t *slot = msu_avllq_next_readable(q, c, cursor, &rd_seq, &seq);
+
+        if (!slot) {
+            if (rd_seq == MSU_AVLLQ_INVALID_SEQ) {
+                /* fell behind while copying, take the spilled items */
+                continue;
+            }
+            return MSU_AVLLQ_STATUS_NO_BUF;
+        }
+
+        size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+        int type = atomic_load_explicit(&slot->type, memory_order_relaxed);
+        uint64_t stamp = LATENCY_STAMP(slot);
+        uint64_t pos = 0;
+        const uint8_t *src;
+
+        if (len > (size_t)q->max_item_size) {
+            /* torn read, the slot is being rewritten */
+            continue;
+        }
+
+        if (q->ring_bytes) {
+            pos = atomic_load_explicit(&slot->pos, memory_order_relaxed);
+            if (RING_OFFSET(q, pos) + len > q->ring_bytes) {
+                continue;
+            }
+
+            if (pos < atomic_load_explicit(&q->min_valid_pos, memory_order_acquire)) {
+                /* evicted by bytes, the newer items are still there */
+                STAT_ADD(c->stat_overrun, 1);
+                msu_avllq_lose_sync(q, c, rd_seq);
+                *cursor = rd_seq + 1;
+                continue;
+            }
+
+            src = q->slab + RING_OFFSET(q, pos);
+        } else {
+            src = atomic_load_explicit(&slot->buf, memory_order_relaxed)->data;
+        }
+
+        void *out_data = msu_avllq_out_get(c, dst, len);
+        if (!out_data) {
+            printf("Failed to alloc memory for output consume data\n");
+            return MSU_AVLLQ_STATUS_MEMORY_ERR;
+        }
+
+        memcpy(out_data, src, len < cap ? len : cap);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            /* the producer wrapped around during the copy, the data may be torn */
+            msu_avllq_out_put(out_data, dst);
+            continue;
+        }
+
+        if (q->ring_bytes && pos < atomic_load_explicit(&q->min_valid_pos, memory_order_relaxed)) {
+            /* bytes overwritten during the copy */
+            msu_avllq_out_put(out_data, dst);
+            STAT_ADD(c->stat_overrun, 1);
+            msu_avllq_lose_sync(q, c, rd_seq);
+            *cursor = rd_seq + 1;
+            continue;
+        }
+
+        if (c->need_sync) {
+            *cursor = rd_seq + 1;
+            if (type != q->keyframe_type) {
+                msu_avllq_out_put(out_data, dst);
+                continue;
+            }
+            c->need_sync = 0;
+        }
+
+        item->type = type;
+        item->len = len;
+        item->data = out_data;
+
+        msu_avllq_account(q, c, rd_seq);
+        LATENCY_RECORD(q, c, stamp);
+        *cursor = rd_seq + 1;
+        break;
+    }
+
+    return MSU_AVLLQ_STATUS_OK;
+}
+
+msu_avllq_status_t msu_avllq_consume_wait(msu_avllq_handle_t q, int consumer_id, msu_avllq_item_t *item,
+                                          int64_t timeout_ns)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+    assert(item != NULL);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec += timeout_ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    for (;;) {
+        msu_avllq_status_t status = msu_avllq_consume(q, consumer_id, item);
+        if (status != MSU_AVLLQ_STATUS_NO_BUF) {
+            return status;
+        }
+
+        int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+        if (consumer_index == -1) {
+            return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+        }
+
+        msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+
+        /* the members of a group park on one futex word, only the producer clears it, all at once */
+        uint32_t unpark = c->group ? 1 : 0;
+
+        /*
+         * announce the wait before checking the queue again, the seq_cst stores pair with the fence
+         * in msu_avllq_wake_consumers(), so either the producer sees us parked or we see its item.
+         */
+        atomic_store_explicit(&c->waiting, 1, memory_order_seq_cst);
+        msu_avllq_request_notify(q, consumer_index);
+
+        uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_seq_cst);
+        if (msu_avllq_local_rd_seq(q, consumer_index, wr_seq) != wr_seq) {
+            atomic_store_explicit(&c->waiting, unpark, memory_order_relaxed);
+            continue;
+        }
+
+        struct timespec *timeout = NULL;
+        struct timespec remaining;
+
+        if (timeout_ns >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000;
+            }
+
+            if (remaining.tv_sec < 0) {
+                atomic_store_explicit(&c->waiting, unpark, memory_order_relaxed);
+                return MSU_AVLLQ_STATUS_TIMEOUT;
+            }
+
+            timeout = &remaining;
+        }
+
+        /* returns at once if the producer has cleared the flag already */
+        if (syscall(SYS_futex, (uint32_t *)&c->waiting, FUTEX_WAIT_PRIVATE, 1,
+                    timeout, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            printf("futex wait failed: %s\n", strerror(errno));
+            atomic_store_explicit(&c->waiting, unpark, memory_order_relaxed);
+            return MSU_AVLLQ_STATUS_ERR;
+        }
+    }
+}
+
+int msu_avllq_consumer_fd(msu_avllq_handle_t q, int consumer_id)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+
+    pthread_mutex_lock(&q->mutex);
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+    if (consumer_index == -1) {
+        pthread_mutex_unlock(&q->mutex);
+        return -1;
+    }
+
+    int efd = atomic_load_explicit(&q->consumers[consumer_index].event_fd, memory_order_relaxed);
+    if (efd == -1) {
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd == -1) {
+            printf("Failed to create eventfd: %s\n", strerror(errno));
+            pthread_mutex_unlock(&q->mutex);
+            return -1;
+        }
+
+        atomic_store_explicit(&q->consumers[consumer_index].event_fd, efd, memory_order_seq_cst);
+        msu_avllq_event_sync(q, consumer_index);
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+
+    return efd;
+}
+
+/* may be called from any thread, the counters of a busy consumer move on while they are read */
+msu_avllq_status_t msu_avllq_get_stats(msu_avllq_handle_t q, int consumer_id, msu_avllq_stats_t *stats)
+{
+    assert(q != NULL);
+    assert(stats != NULL);
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+
+    if (consumer_index == -1) {
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+    uint64_t cursor = atomic_load_explicit(&c->rd_seq, memory_order_acquire);
+    uint64_t oldest = MSU_AVLLQ_OLDEST_SEQ(q, wr_seq);
+
+    stats->consumed = atomic_load_explicit(&c->stat_consumed, memory_order_relaxed);
+    stats->overrun = atomic_load_explicit(&c->stat_overrun, memory_order_relaxed);
+    stats->max_lag = atomic_load_explicit(&c->stat_max_lag, memory_order_relaxed);
+
+    /* overrun not noticed by the consumer yet, a spilling consumer still has the items */
+    if (cursor < oldest && c->policy != MSU_AVLLQ_POLICY_SPILL) {
+        stats->overrun += oldest - cursor;
+        cursor = oldest;
+    }
+
+    stats->lag = wr_seq > cursor ? wr_seq - cursor : 0;
+
+    return MSU_AVLLQ_STATUS_OK;
+}
+
+/* percentiles are reported as the highest value of their bucket, at most 1/8 above the real value */
+msu_avllq_status_t msu_avllq_get_latency(msu_avllq_handle_t q, int consumer_id, msu_avllq_latency_t *latency,
+                                         int reset)
+{
+    assert(q != NULL);
+    assert(latency != NULL);
+
+#if MSU_AVLLQ_LATENCY
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total = 0;
+
+    memset(latency, 0, sizeof(*latency));
+
+    /* serializes snapshots and resets */
+    pthread_mutex_lock(&q->mutex);
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+    if (consumer_index == -1) {
+        pthread_mutex_unlock(&q->mutex);
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    if (!c->latency) {
+        pthread_mutex_unlock(&q->mutex);
+        printf("Latency tracking is not enabled\n");
+        return MSU_AVLLQ_STATUS_ERR;
+    }
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        counts[b] = atomic_load_explicit(&c->latency[b], memory_order_relaxed) - c->latency_base[b];
+        total += counts[b];
+        if (reset) {
+            c->latency_base[b] += counts[b];
+        }
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+
+    latency->count = total;
+    if (total == 0) {
+        return MSU_AVLLQ_STATUS_OK;
+    }
+
+    uint64_t p50 = (total * 500 + 999) / 1000;
+    uint64_t p99 = (total * 990 + 999) / 1000;
+    uint64_t p999 = (total * 999 + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        if (!counts[b]) {
+            continue;
+        }
+
+        uint64_t value = msu_avllq_latency_bucket_max(b);
+        if (seen == 0) {
+            latency->min_ns = value;
+        }
+
+        seen += counts[b];
+        if (latency->p50_ns == 0 && seen >= p50) {
+            latency->p50_ns = value;
+        }
+        if (latency->p99_ns == 0 && seen >= p99) {
+            latency->p99_ns = value;
+        }
+        if (latency->p999_ns == 0 && seen >= p999) {
+            latency->p999_ns = value;
+        }
+        latency->max_ns = value;
+    }
+
+    return MSU_AVLLQ_STATUS_OK;
+#else
+    (void)consumer_id;
+    (void)reset;
+    printf("Latency tracking is compiled out\n");
+    return MSU_AVLLQ_STATUS_ERR;
+#endif
+}
+
+void msu_avllq_item_release(msu_avllq_item_t const* item)
+{
+    assert(item != NULL);
+
+    if (item->data) {
+        msu_avllq_out_free(item->data);
+    }
+}
+
+/* one consumer id must not be consumed by multiple threads at the same time */
+msu_avllq_status_t msu_avllq_borrow(msu_avllq_handle_t q, int consumer_id, msu_avllq_item_t *item)
+{
+    assert(q != NULL);
+    assert(consumer_id != -1);
+    assert(item != NULL);
+
+    if (q->ring_bytes) {
+        printf("Borrow is not supported in ring mode\n");
+        return MSU_AVLLQ_STATUS_ERR;
+    }
+
+    int consumer_index = msu_avllq_find_consumer_index(q, consumer_id);
+
+    if (consumer_index == -1) {
+        printf("Consumer %d not registered", consumer_id);
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    if (c->group || c->policy == MSU_AVLLQ_POLICY_SPILL) {
+        printf("Borrow is not supported by consumer groups and spilling consumers\n");
+        return MSU_AVLLQ_STATUS_ERR;
+    }
+
+    uint64_t cursor = msu_avllq_cursor(q, consumer_index);
+
+    for (;;) {
+        if (q->keyframe_policy) {
+            cursor = msu_avllq_keyframe_sync(q, c, cursor);
+
+            size_t key_len;
+            msu_avllq_buf_t *key_buf = msu_avllq_pinned_keyframe(q, c, &key_len);
+            if (key_buf) {
+                /* the reference taken is dropped by msu_avllq_return() */
+                item->type = q->keyframe_type;
+                item->len = key_len;
+                item->data = key_buf->data;
+
+                msu_avllq_account(q, c, cursor);
+                msu_avllq_consumed(q, consumer_index, cursor);
+                break;
+            }
+        }
+
+        uint64_t rd_seq, seq;
+        msu_avllq_slot_t *slot = msu_avllq_next_readable(q, c, &cursor, &rd_seq, &seq);
+
+        if (!slot) {
+            msu_avllq_consumed(q, consumer_index, cursor);
+            return MSU_AVLLQ_STATUS_NO_BUF;
+        }
+
+        size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+        int type = atomic_load_explicit(&slot->type, memory_order_relaxed);
+        uint64_t stamp = LATENCY_STAMP(slot);
+        msu_avllq_buf_t *buf = atomic_load_explicit(&slot->buf, memory_order_relaxed);
+
+        if (!msu_avllq_buf_try_ref(buf)) {
+            /* stale pointer to a buffer on the spare list */
+            continue;
+        }
+
+        /*
+         * pairs with the fence in produce: either the producer sees our reference and swaps the
+         * buffer out, or we see the slot being rewritten here.
+         */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq ||
+            atomic_load_explicit(&slot->buf, memory_order_relaxed) != buf) {
+            msu_avllq_buf_unref(q, buf);
+            continue;
+        }
+
+        if (c->need_sync) {
+            cursor = rd_seq + 1;
+            if (type != q->keyframe_type) {
+                msu_avllq_buf_unref(q, buf);
+                continue;
+            }
+            c->need_sync = 0;
+        }
+
+        item->type = type;
+        item->len = len;
+        item->data = buf->data;
+
+        msu_avllq_account(q, c, rd_seq);
+        LATENCY_RECORD(q, c, stamp);
+        msu_avllq_consumed(q, consumer_index, rd_seq + 1);
+        break;
+    }
+
+    return MSU_AVLLQ_STATUS_OK;
+}
+
+void msu_avllq_return(msu_avllq_handle_t q, msu_avllq_item_t const *item)
+{
+    assert(q != NULL);
+    assert(item != NULL);
+
+    msu_avllq_buf_unref(q, BUF_OF_DATA(item->data));
+}
+
+msu_avllq_lanes_handle_t msu_avllq_lanes_create(const msu_avllq_lane_config_t *lanes, int nr_lanes)
+{
+    assert(lanes != NULL);
+
+    if (nr_lanes < 1 || nr_lanes > MSU_AVLLQ_MAX_LANES) {
+        printf("Illegal number of msu_avllq lanes: %d\n", nr_lanes);
+        return NULL;
+    }
+
+    for (int l = 0; l < nr_lanes; l++) {
+        for (int k = 0; k < l; k++) {
+            if (lanes[k].type == lanes[l].type) {
+                printf("Lanes %d and %d have the same type %d\n", k, l, lanes[l].type);
+                return NULL;
+            }
+        }
+    }
+
+    msu_avllq_lanes_handle_t lq = (msu_avllq_lanes_handle_t)calloc(1, sizeof(struct msu_avllq_lanes_s));
+    if (!lq) {
+        printf("Failed to alloc msu_avllq lanes\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&lq->mutex, NULL);
+    lq->max_consumers = MSU_AVLLQ_MAX_CONSUMER_LIMIT;
+
+    for (int l = 0; l < nr_lanes; l++) {
+        lq->lanes[l] = msu_avllq_create2(&lanes[l].config);
+        if (!lq->lanes[l]) {
+            msu_avllq_lanes_destroy(lq);
+            return NULL;
+        }
+
+        lq->types[l] = lanes[l].type;
+        lq->nr_lanes++;
+
+        if (lq->lanes[l]->max_consumers < lq->max_consumers) {
+            lq->max_consumers = lq->lanes[l]->max_consumers;
+        }
+    }
+
+    lq->consumers = (_Atomic int *)malloc(lq->max_consumers * sizeof(int));
+    lq->generations = (int *)calloc(lq->max_consumers, sizeof(int));
+    lq->lane_consumers = (int *)malloc((size_t)lq->max_consumers * nr_lanes * sizeof(int));
+    if (!lq->consumers || !lq->generations || !lq->lane_consumers) {
+        printf("Failed to alloc %d msu_avllq lanes consumers\n", lq->max_consumers);
+        msu_avllq_lanes_destroy(lq);
+        return NULL;
+    }
+
+    for (int i = 0; i < lq->max_consumers; i++) {
+        atomic_init(&lq->consumers[i], -1);
+    }
+
+    return lq;
+}
+
+void msu_avllq_lanes_destroy(msu_avllq_lanes_handle_t lq)
+{
+    if (!lq) {
+        return;
+    }
+
+    for (int l = 0; l < lq->nr_lanes; l++) {
+        msu_avllq_destroy(lq->lanes[l]);
+    }
+
+    free(lq->consumers);
+    free(lq->generations);
+    free(lq->lane_consumers);
+    pthread_mutex_destroy(&lq->mutex);
+    free(lq);
+}
+
+int msu_avllq_lanes_register_consumer(msu_avllq_lanes_handle_t lq)
+{
+    assert(lq != NULL);
+
+    int consumer_id = -1;
+
+    pthread_mutex_lock(&lq->mutex);
+
+    for (int i = 0; i < lq->max_consumers; i++) {
+        if (atomic_load_explicit(&lq->consumers[i], memory_order_relaxed) != -1) {
+            continue;
+        }
+
+        int *ids = &lq->lane_consumers[i * lq->nr_lanes];
+        int l;
+
+        for (l = 0; l < lq->nr_lanes; l++) {
+            ids[l] = msu_avllq_register_consumer(lq->lanes[l]);
+            if (ids[l] == -1) {
+                break;
+            }
+        }
+
+        if (l < lq->nr_lanes) {
+            while (l-- > 0) {
+                msu_avllq_deregister_consumer(lq->lanes[l], ids[l]);
+            }
+            break;
+        }
+
+        lq->generations[i] = (lq->generations[i] + 1) & CONSUMER_GENERATION_MASK;
+        consumer_id = CONSUMER_ID(lq->generations[i], i);
+        atomic_store_explicit(&lq->consumers[i], consumer_id, memory_order_release);
+        break;
+    }
+
+    pthread_mutex_unlock(&lq->mutex);
+
+    return consumer_id;
+}
+
+/*
+ * the lane consumer ids of a lanes consumer, NULL if it is not registered. The entry index is encoded in the
+ * consumer id, a stale id fails the generation check.
+ */
+static int *msu_avllq_lanes_find_consumer(msu_avllq_lanes_handle_t lq, int consumer_id)
+{
+    int i = consumer_id < 0 ? -1 : (consumer_id & CONSUMER_INDEX_MASK);
+
+    if (i == -1 || i >= lq->max_consumers ||
+        atomic_load_explicit(&lq->consumers[i], memory_order_acquire) != consumer_id) {
+        printf("No lanes consumer_id %d found\n", consumer_id);
+        return NULL;
+    }
+
+    return &lq->lane_consumers[i * lq->nr_lanes];
+}
+
+void msu_avllq_lanes_deregister_consumer(msu_avllq_lanes_handle_t lq, int consumer_id)
+{
+    assert(lq != NULL);
+
+    pthread_mutex_lock(&lq->mutex);
+
+    int *ids = msu_avllq_lanes_find_consumer(lq, consumer_id);
+    if (ids) {
+        for (int l = 0; l < lq->nr_lanes; l++) {
+            msu_avllq_deregister_consumer(lq->lanes[l], ids[l]);
+        }
+
+        atomic_store_explicit(&lq->consumers[consumer_id & CONSUMER_INDEX_MASK], -1, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&lq->mutex);
+}
+
+msu_avllq_status_t msu_avllq_lanes_produce2(msu_avllq_lanes_handle_t lq, const void *data, size_t len, int type)
+{
+    assert(lq != NULL);
+
+    for (int l = 0; l < lq->nr_lanes; l++) {
+        if (lq->types[l] == type) {
+            return msu_avllq_produce2(lq->lanes[l], data, len, type);
+        }
+    }
+
+    printf("No msu_avllq lane for type %d\n", type);
+
+    return MSU_AVLLQ_STATUS_ERR;
+}
+
+/* one consumer id must not be consumed by multiple threads at the same time */
+msu_avllq_status_t msu_avllq_lanes_consume(msu_avllq_lanes_handle_t lq, int consumer_id, msu_avllq_item_t *item)
+{
+    assert(lq != NULL);
+    assert(item != NULL);
+
+    int *ids = msu_avllq_lanes_find_consumer(lq, consumer_id);
+    if (!ids) {
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    for (int l = 0; l < lq->nr_lanes; l++) {
+        msu_avllq_status_t status = msu_avllq_consume(lq->lanes[l], ids[l], item);
+        if (status != MSU_AVLLQ_STATUS_NO_BUF) {
+            return status;
+        }
+    }
+
+    return MSU_AVLLQ_STATUS_NO_BUF;
+}
+
+/* waits on the eventfds of the consumer in all lanes, they stay readable while a lane has unread items */
+msu_avllq_status_t msu_avllq_lanes_consume_wait(msu_avllq_lanes_handle_t lq, int consumer_id, msu_avllq_item_t *item,
+                                                int64_t timeout_ns)
+{
+    assert(lq != NULL);
+    assert(item != NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t deadline = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec + timeout_ns;
+
+    int *ids = msu_avllq_lanes_find_consumer(lq, consumer_id);
+    if (!ids) {
+        return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+    }
+
+    /* fetched once, msu_avllq_consumer_fd() takes the registration mutex of the lane */
+    struct pollfd fds[MSU_AVLLQ_MAX_LANES];
+    for (int l = 0; l < lq->nr_lanes; l++) {
+        fds[l].fd = msu_avllq_consumer_fd(lq->lanes[l], ids[l]);
+        fds[l].events = POLLIN;
+        if (fds[l].fd == -1) {
+            return MSU_AVLLQ_STATUS_ERR;
+        }
+    }
+
+    for (;;) {
+        msu_avllq_status_t status = msu_avllq_lanes_consume(lq, consumer_id, item);
+        if (status != MSU_AVLLQ_STATUS_NO_BUF) {
+            return status;
+        }
+
+        int timeout_ms = -1;
+        if (timeout_ns >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t remaining = deadline - ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+            if (remaining < 0) {
+                return MSU_AVLLQ_STATUS_TIMEOUT;
+            }
+
+            timeout_ms = (int)((remaining + 999999) / 1000000);
+        }
+
+        if (poll(fds, lq->nr_lanes, timeout_ms) == -1 && errno != EINTR) {
+            printf("poll failed: %s\n", strerror(errno));
+            return MSU_AVLLQ_STATUS_ERR;
+        }
+    }
+}
+
+msu_avllq_handle_t msu_avllq_lanes_queue(msu_avllq_lanes_handle_t lq, int lane, int consumer_id, int *lane_consumer_id)
+{
+    assert(lq != NULL);
+
+    if (lane < 0 || lane >= lq->nr_lanes) {
+        return NULL;
+    }
+
+    if (lane_consumer_id) {
+        int *ids = consumer_id == -1 ? NULL : msu_avllq_lanes_find_consumer(lq, consumer_id);
+        *lane_consumer_id = ids ? ids[lane] : -1;
+    }
+
+    return lq->lanes[lane];
+}
+
+static int msu_avllq_find_consumer_index(msu_avllq_handle_t q, int consumer_id)
+{
+    int idx = consumer_id < 0 ? -1 : (consumer_id & CONSUMER_INDEX_MASK);
+
+    if (idx == -1 || idx >= q->max_consumers ||
+        atomic_load_explicit(&q->consumers[idx].id, memory_order_acquire) != consumer_id) {
+        printf("No consumer_id %d found\n", consumer_id);
+        idx = -1;
+    }
+
+    return idx;
+}
+
+/*
+ * find the next published item at or after cursor, NULL if everything has been read. Items overrun are skipped,
+ * unless they are spilled: then NULL with *rd_seq MSU_AVLLQ_INVALID_SEQ, the cursor is left where it is.
+ */
+static msu_avllq_slot_t *msu_avllq_next_readable(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor,
+                                                 uint64_t *rd_seq, uint64_t *seq)
+{
+    for (;;) {
+        uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+
+        if (c->policy == MSU_AVLLQ_POLICY_SPILL && *cursor < MSU_AVLLQ_OLDEST_SEQ(q, wr_seq) &&
+            atomic_load_explicit(&c->spill_count, memory_order_relaxed)) {
+            *rd_seq = MSU_AVLLQ_INVALID_SEQ;
+            return NULL;
+        }
+
+        msu_avllq_catch_up(q, c, cursor, wr_seq);
+
+        uint64_t next = *cursor;
+
+        if (next == wr_seq) {
+            *rd_seq = wr_seq;
+            return NULL;
+        }
+
+        msu_avllq_slot_t *slot = &q->slots[SLOT_INDEX(q, next)];
+
+        *seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (*seq == SEQLOCK_PUBLISHED(next)) {
+            *rd_seq = next;
+            return slot;
+        }
+
+        /* below the write seq but never published, a multi producer ticket given up */
+        if (*seq == SEQLOCK_WRITING(next)) {
+            (*cursor)++;
+            continue;
+        }
+
+        /* overwritten by producer, the window has moved on */
+    }
+}
+
+/* the stored local read seq, only the consumer itself moves it */
+static uint64_t msu_avllq_cursor(msu_avllq_handle_t q, int consumer_index)
+{
+    return atomic_load_explicit(&q->consumers[consumer_index].rd_seq, memory_order_relaxed);
+}
+
+/*
+ * advance the local read seq to cursor. The global read seq is derived from the slowest consumer when
+ * it is queried, so consume does not touch any shared state besides its own cursor.
+ */
+static void msu_avllq_consumed(msu_avllq_handle_t q, int consumer_index, uint64_t cursor)
+{
+    atomic_store_explicit(&q->consumers[consumer_index].rd_seq, cursor, memory_order_release);
+
+    if (q->consumers[consumer_index].policy == MSU_AVLLQ_POLICY_BLOCK) {
+        msu_avllq_wake_producer(q);
+    }
+
+    msu_avllq_event_sync(q, consumer_index);
+}
+
+/* producer only, the buffer is owned by the slot */
+static msu_avllq_buf_t *msu_avllq_buf_alloc(msu_avllq_handle_t q)
+{
+    void *mem;
+    if (posix_memalign(&mem, MSU_AVLLQ_BUF_ALIGN, BUF_STRIDE(q)) != 0) {
+        return NULL;
+    }
+
+    msu_avllq_buf_t *buf = (msu_avllq_buf_t *)mem;
+
+    atomic_init(&buf->ref_count, 1);
+    buf->next = NULL;
+    buf->all_next = q->all_bufs;
+    q->all_bufs = buf;
+
+    return buf;
+}
+
+/* producer only, called with the slot marked as being written */
+static msu_avllq_buf_t *msu_avllq_writable_buf(msu_avllq_handle_t q, msu_avllq_slot_t *slot)
+{
+    msu_avllq_buf_t *buf = atomic_load_explicit(&slot->buf, memory_order_relaxed);
+
+    /* acquire pairs with the unref of the last borrower, who must be done reading */
+    if (atomic_load_explicit(&buf->ref_count, memory_order_acquire) == 1) {
+        return buf;
+    }
+
+    /* pinned by borrowers, the single popper of the spare list is the producer, so no ABA */
+    if (q->producers > 1) {
+        pthread_mutex_lock(&q->buf_mutex);
+    }
+
+    msu_avllq_buf_t *spare = atomic_load_explicit(&q->spare_bufs, memory_order_acquire);
+    while (spare && !atomic_compare_exchange_weak_explicit(&q->spare_bufs, &spare, spare->next,
+                                                           memory_order_acquire, memory_order_acquire)) {
+    }
+
+    if (spare) {
+        atomic_store_explicit(&spare->ref_count, 1, memory_order_relaxed);
+    } else {
+        spare = msu_avllq_buf_alloc(q);
+    }
+
+    if (q->producers > 1) {
+        pthread_mutex_unlock(&q->buf_mutex);
+    }
+
+    if (!spare) {
+        return NULL;
+    }
+
+    atomic_store_explicit(&slot->buf, spare, memory_order_relaxed);
+
+    /* drop the reference of the slot, the last borrower moves it to the spare list */
+    msu_avllq_buf_unref(q, buf);
+
+    return spare;
+}
+
+/*
+ * producer only, place len bytes in the ring without wrapping around its end. The bytes about to be
+ * overwritten are invalidated before the caller writes, the fence orders it before the data stores.
+ */
+static uint8_t *msu_avllq_ring_reserve(msu_avllq_handle_t q, size_t len)
+{
+    uint64_t pos = q->ring_wr_pos;
+
+    if (RING_OFFSET(q, pos) + len > q->ring_bytes) {
+        pos = ALIGN_UP(pos, q->ring_bytes);
+    }
+
+    if (pos + len > q->ring_bytes) {
+        uint64_t min_valid_pos = pos + len - q->ring_bytes;
+        if (min_valid_pos > atomic_load_explicit(&q->min_valid_pos, memory_order_relaxed)) {
+            atomic_store_explicit(&q->min_valid_pos, min_valid_pos, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+        }
+    }
+
+    q->reserved_pos = pos;
+
+    return q->slab + RING_OFFSET(q, pos);
+}
+
+/* calloc() honoring the cache line alignment of the control structures */
+static void *msu_avllq_aligned_calloc(size_t n, size_t size)
+{
+    void *mem;
+    if (posix_memalign(&mem, MSU_AVLLQ_CACHE_LINE, n * size) != 0) {
+        return NULL;
+    }
+
+    memset(mem, 0, n * size);
+
+    return mem;
+}
+
+/*
+ * back all preserved buffers by one contiguous arena. Explicit huge pages are tried first and prefaulted,
+ * otherwise the arena is aligned to the huge page size and left to transparent huge pages.
+ */
+static int msu_avllq_slab_alloc(msu_avllq_handle_t q, size_t size)
+{
+    q->slab_size = ALIGN_UP(size, MSU_AVLLQ_HUGE_PAGE_SIZE);
+
+    void *mem = mmap(NULL, q->slab_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (mem != MAP_FAILED) {
+        q->slab = (uint8_t *)mem;
+        q->slab_mapped = 1;
+        return 0;
+    }
+
+    if (posix_memalign(&mem, MSU_AVLLQ_HUGE_PAGE_SIZE, q->slab_size) != 0) {
+        q->slab_size = 0;
+        return -1;
+    }
+
+    /* best effort, THP may be disabled */
+    madvise(mem, q->slab_size, MADV_HUGEPAGE);
+
+    q->slab = (uint8_t *)mem;
+    q->slab_mapped = 0;
+
+    return 0;
+}
+
+/* take a reference unless the buffer is already on the spare list */
+static int msu_avllq_buf_try_ref(msu_avllq_buf_t *buf)
+{
+    int ref_count = atomic_load_explicit(&buf->ref_count, memory_order_relaxed);
+
+    while (ref_count > 0) {
+        if (atomic_compare_exchange_weak_explicit(&buf->ref_count, &ref_count, ref_count + 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void msu_avllq_buf_unref(msu_avllq_handle_t q, msu_avllq_buf_t *buf)
+{
+    if (atomic_fetch_sub_explicit(&buf->ref_count, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    msu_avllq_buf_t *head = atomic_load_explicit(&q->spare_bufs, memory_order_relaxed);
+    do {
+        buf->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&q->spare_bufs, &head, buf,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+static msu_avllq_pool_t *msu_avllq_pool_create(msu_avllq_handle_t q, const msu_avllq_consumer_config_t *config)
+{
+    msu_avllq_pool_t *pool = (msu_avllq_pool_t *)calloc(1, sizeof(msu_avllq_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    atomic_init(&pool->refs, 1);
+    atomic_init(&pool->closed, 0);
+    atomic_init(&pool->returned, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->local = NULL;
+    pool->size = q->max_item_size;
+
+    if (config && config->out_alloc) {
+        pool->alloc = config->out_alloc;
+        pool->free = config->out_free;
+        pool->ctx = config->out_ctx;
+    }
+
+    return pool;
+}
+
+/* the registration is gone, buffers released from now on are freed and the last one frees the pool */
+static void msu_avllq_pool_close(msu_avllq_pool_t *pool)
+{
+    atomic_store_explicit(&pool->closed, 1, memory_order_release);
+    msu_avllq_pool_unref(pool);
+}
+
+static void msu_avllq_pool_unref(msu_avllq_pool_t *pool)
+{
+    if (atomic_fetch_sub_explicit(&pool->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    msu_avllq_out_t *out = atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire);
+    while (out) {
+        msu_avllq_out_t *next = out->next;
+        free(out);
+        out = next;
+    }
+
+    out = pool->local;
+    while (out) {
+        msu_avllq_out_t *next = out->next;
+        free(out);
+        out = next;
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/* consumer side, a buffer for a consumed item of len bytes. Steady state pops the free list, no malloc */
+static void *msu_avllq_out_alloc(msu_avllq_consumer_t *c, size_t len)
+{
+    msu_avllq_pool_t *pool = c->pool;
+    msu_avllq_out_t *out;
+
+    if (pool->alloc) {
+        out = (msu_avllq_out_t *)pool->alloc(pool->ctx, sizeof(msu_avllq_out_t) + len);
+    } else {
+        if (c->group) {
+            pthread_mutex_lock(&pool->mutex);
+        }
+
+        if (!pool->local) {
+            pool->local = atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire);
+        }
+
+        out = pool->local;
+        if (out) {
+            pool->local = out->next;
+        }
+
+        if (c->group) {
+            pthread_mutex_unlock(&pool->mutex);
+        }
+
+        if (!out) {
+            assert(len <= pool->size);
+            out = (msu_avllq_out_t *)malloc(sizeof(msu_avllq_out_t) + pool->size);
+        }
+    }
+
+    if (!out) {
+        return NULL;
+    }
+
+    out->pool = pool;
+    atomic_fetch_add_explicit(&pool->refs, 1, memory_order_relaxed);
+
+    return out->data;
+}
+
+/* any thread, hand a consumed item buffer back to its pool */
+static void msu_avllq_out_free(void *data)
+{
+    msu_avllq_out_t *out = OUT_OF_DATA(data);
+    msu_avllq_pool_t *pool = out->pool;
+
+    if (!pool) {
+        free(out);
+        return;
+    }
+
+    if (pool->alloc) {
+        pool->free(pool->ctx, out);
+    } else if (atomic_load_explicit(&pool->closed, memory_order_acquire)) {
+        free(out);
+    } else {
+        msu_avllq_out_t *head = atomic_load_explicit(&pool->returned, memory_order_relaxed);
+        do {
+            out->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&pool->returned, &head, out,
+                                                        memory_order_release, memory_order_relaxed));
+    }
+
+    msu_avllq_pool_unref(pool);
+}
+
+/* consumer side, where a consumed item goes: the buffer of the caller if there is one, else a pooled buffer */
+static void *msu_avllq_out_get(msu_avllq_consumer_t *c, void *dst, size_t len)
+{
+    return dst ? dst : msu_avllq_out_alloc(c, len);
+}
+
+/* consumer side, drop a copy which turned out torn */
+static void msu_avllq_out_put(void *data, void *dst)
+{
+    if (data != dst) {
+        msu_avllq_out_free(data);
+    }
+}
+
+/* producer only, publish the reserved item without waking up consumers */
+static void msu_avllq_publish(msu_avllq_handle_t q, size_t len, int type)
+{
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_relaxed);
+    msu_avllq_slot_t *slot = &q->slots[SLOT_INDEX(q, wr_seq)];
+
+    atomic_store_explicit(&slot->len, len, memory_order_relaxed);
+    atomic_store_explicit(&slot->type, type, memory_order_relaxed);
+
+    if (q->ring_bytes) {
+        atomic_store_explicit(&slot->pos, q->reserved_pos, memory_order_relaxed);
+        q->ring_wr_pos = ALIGN_UP(q->reserved_pos + len, MSU_AVLLQ_BUF_ALIGN);
+    }
+
+#if MSU_AVLLQ_LATENCY
+    if (q->track_latency) {
+        atomic_store_explicit(&slot->stamp, msu_avllq_now_ns(), memory_order_relaxed);
+    }
+#endif
+
+    atomic_store_explicit(&slot->seq, SEQLOCK_PUBLISHED(wr_seq), memory_order_release);
+
+    q->reserved_data = NULL;
+
+    /*
+     * publishing the new write seq drops the oldest item out of the window if the queue is full,
+     * both the global and the local read seqs catch up lazily when they are read.
+     */
+    atomic_store_explicit(&q->wr_seq, wr_seq + 1, memory_order_release);
+
+    if (q->keyframe_policy && type == q->keyframe_type) {
+        msu_avllq_pin_keyframe(q, wr_seq, slot, len);
+    }
+}
+
+/* multi producer, wait until seq reaches target. Spins briefly, the producer ahead is usually copying */
+static void msu_avllq_mp_wait(_Atomic uint64_t *seq, uint64_t target)
+{
+    for (int spin = 0; atomic_load_explicit(seq, memory_order_acquire) < target; spin++) {
+        if (spin >= 64) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * multi producer, return the buffer of the slot of ticket, NULL if no buffer can be allocated. The item
+ * the slot holds is in the window until the tickets up to (producers - 1) before have been published.
+ */
+static uint8_t *msu_avllq_mp_claim(msu_avllq_handle_t q, uint64_t ticket)
+{
+    uint64_t ahead = (uint64_t)q->producers - 1;
+
+    msu_avllq_mp_wait(&q->wr_seq, ticket > ahead ? ticket - ahead : 0);
+
+    msu_avllq_slot_t *slot = &q->slots[SLOT_INDEX(q, ticket)];
+
+    atomic_store_explicit(&slot->seq, SEQLOCK_WRITING(ticket), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    msu_avllq_buf_t *buf = msu_avllq_writable_buf(q, slot);
+    if (!buf) {
+        printf("Failed to alloc spare buf\n");
+        return NULL;
+    }
+
+    return buf->data;
+}
+
+/*
+ * multi producer, publish the item of ticket once all tickets before are published. len 0 gives the ticket
+ * up: the write seq moves past the slot left marked as being written, and consumers skip it.
+ */
+static void msu_avllq_mp_publish(msu_avllq_handle_t q, uint64_t ticket, size_t len, int type)
+{
+    msu_avllq_mp_wait(&q->publish_turn, ticket);
 
-    return msu_avllq_compare_read_speed2(q, idx);
+    if (len) {
+        msu_avllq_publish(q, len, type);
+    } else {
+        atomic_store_explicit(&q->wr_seq, ticket + 1, memory_order_release);
+    }
+
+    atomic_store_explicit(&q->publish_turn, ticket + 1, memory_order_release);
 }
 
-uint8_t msu_avllq_slowest_rd_off(msu_avllq_handle_t q)
+/*
+ * producer only, remember the latest keyframe. In buffer mode the keyframe buffer is pinned by a reference,
+ * so it survives the slot being overwritten until a newer keyframe arrives. key_seq doubles as the seqlock
+ * of key_buf and key_len, MSU_AVLLQ_INVALID_SEQ while they are updated.
+ */
+static void msu_avllq_pin_keyframe(msu_avllq_handle_t q, uint64_t seq, msu_avllq_slot_t *slot, size_t len)
 {
-    assert(q != NULL);
+    if (q->ring_bytes) {
+        atomic_store_explicit(&q->key_seq, seq, memory_order_release);
+        return;
+    }
+
+    msu_avllq_buf_t *buf = atomic_load_explicit(&slot->buf, memory_order_relaxed);
+    msu_avllq_buf_t *old = atomic_load_explicit(&q->key_buf, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&buf->ref_count, 1, memory_order_relaxed);
+
+    atomic_store_explicit(&q->key_seq, MSU_AVLLQ_INVALID_SEQ, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->key_buf, buf, memory_order_relaxed);
+    atomic_store_explicit(&q->key_len, len, memory_order_relaxed);
+    atomic_store_explicit(&q->key_seq, seq, memory_order_release);
+
+    if (old) {
+        msu_avllq_buf_unref(q, old);
+    }
+}
+
+/*
+ * keyframe policy: a consumer which just joined or lost items restarts at a keyframe. Jump to the latest
+ * keyframe if it is still in the window, otherwise the items are skipped until the next one.
+ */
+static uint64_t msu_avllq_keyframe_sync(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t cursor)
+{
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+
+    msu_avllq_catch_up(q, c, &cursor, wr_seq);
+
+    if (!c->need_sync) {
+        return cursor;
+    }
+
+    /* the cursor is in the window after catching up */
+    uint64_t key_seq = atomic_load_explicit(&q->key_seq, memory_order_acquire);
+    if (key_seq != MSU_AVLLQ_INVALID_SEQ && key_seq >= cursor && key_seq < wr_seq) {
+        return key_seq;
+    }
+
+    return cursor;
+}
+
+/*
+ * consumer side, move a cursor which fell out of the window to the oldest item and count the overrun. A consumer
+ * which started at a pinned keyframe behind the window is not charged for the items before its start.
+ */
+static void msu_avllq_catch_up(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t *cursor, uint64_t wr_seq)
+{
+    uint64_t oldest = MSU_AVLLQ_OLDEST_SEQ(q, wr_seq);
+
+    if (*cursor < oldest) {
+        uint64_t from = *cursor > c->overrun_floor ? *cursor : c->overrun_floor;
+        if (oldest > from) {
+            STAT_ADD(c->stat_overrun, oldest - from);
+        }
+        msu_avllq_lose_sync(q, c, *cursor);
+        *cursor = oldest;
+    }
+}
+
+/* keyframe policy, the consumer lost items from cursor on and waits for a keyframe */
+static void msu_avllq_lose_sync(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t cursor)
+{
+    if (q->keyframe_policy && !c->need_sync) {
+        c->need_sync = 1;
+        c->key_floor = cursor;
+    }
+}
+
+/* consumer side, an item is handed out, rd_seq tells how far behind the producer the consumer is */
+static void msu_avllq_account(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t rd_seq)
+{
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_relaxed);
+    uint64_t lag = wr_seq > rd_seq ? wr_seq - rd_seq : 0;
+
+    if (c->group) {
+        uint64_t max_lag = atomic_load_explicit(&c->stat_max_lag, memory_order_relaxed);
+
+        STAT_ADD_SHARED(c->stat_consumed, 1);
+        while (lag > max_lag && !atomic_compare_exchange_weak_explicit(&c->stat_max_lag, &max_lag, lag,
+                                                                       memory_order_relaxed, memory_order_relaxed)) {
+        }
+        return;
+    }
+
+    STAT_ADD(c->stat_consumed, 1);
+    if (lag > atomic_load_explicit(&c->stat_max_lag, memory_order_relaxed)) {
+        atomic_store_explicit(&c->stat_max_lag, lag, memory_order_relaxed);
+    }
+}
+
+/*
+ * consumer group: the members share the entry and its cursor. An item is claimed by moving the cursor past
+ * it with a CAS before it is copied, so it goes to one member only and the copies run in parallel.
+ */
+static msu_avllq_status_t msu_avllq_group_consume(msu_avllq_handle_t q, int consumer_index, msu_avllq_item_t *item,
+                                                  void *dst, size_t cap)
+{
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    uint64_t cursor = atomic_load_explicit(&c->rd_seq, memory_order_relaxed);
+
+    for (;;) {
+        uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+        uint64_t oldest = MSU_AVLLQ_OLDEST_SEQ(q, wr_seq);
+        uint64_t next = cursor < oldest ? oldest : cursor;
+
+        if (next >= wr_seq) {
+            msu_avllq_event_sync(q, consumer_index);
+            return MSU_AVLLQ_STATUS_NO_BUF;
+        }
+
+        if (!atomic_compare_exchange_weak_explicit(&c->rd_seq, &cursor, next + 1,
+                                                   memory_order_acq_rel, memory_order_relaxed)) {
+            /* another member claimed it, cursor is reloaded */
+            continue;
+        }
+
+        if (next > cursor) {
+            STAT_ADD_SHARED(c->stat_overrun, next - cursor);
+        }
+        cursor = next + 1;
+
+        if (c->policy == MSU_AVLLQ_POLICY_BLOCK) {
+            msu_avllq_wake_producer(q);
+        }
+
+        msu_avllq_status_t status = msu_avllq_claimed_copy(q, c, next, item, dst, cap);
+        if (status != MSU_AVLLQ_STATUS_NO_BUF) {
+            msu_avllq_event_sync(q, consumer_index);
+            return status;
+        }
+    }
+}
+
+/* consumer group, copy out the item at rd_seq claimed by the caller like msu_avllq_copy_next(). NO_BUF if it is gone */
+static msu_avllq_status_t msu_avllq_claimed_copy(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t rd_seq,
+                                                 msu_avllq_item_t *item, void *dst, size_t cap)
+{
+    msu_avllq_slot_t *slot = &q->slots[SLOT_INDEX(q, rd_seq)];
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq == SEQLOCK_WRITING(rd_seq)) {
+        /* a multi producer ticket given up */
+        return MSU_AVLLQ_STATUS_NO_BUF;
+    }
+
+    size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+    int type = atomic_load_explicit(&slot->type, memory_order_relaxed);
+    uint64_t stamp = LATENCY_STAMP(slot);
+
+    /* a torn length means the slot is being rewritten too */
+    if (seq != SEQLOCK_PUBLISHED(rd_seq) || len > (size_t)q->max_item_size) {
+        STAT_ADD_SHARED(c->stat_overrun, 1);
+        return MSU_AVLLQ_STATUS_NO_BUF;
+    }
+
+    void *out_data = msu_avllq_out_get(c, dst, len);
+    if (!out_data) {
+        printf("Failed to alloc memory for output consume data\n");
+        return MSU_AVLLQ_STATUS_MEMORY_ERR;
+    }
+
+    memcpy(out_data, atomic_load_explicit(&slot->buf, memory_order_relaxed)->data, len < cap ? len : cap);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        msu_avllq_out_put(out_data, dst);
+        STAT_ADD_SHARED(c->stat_overrun, 1);
+        return MSU_AVLLQ_STATUS_NO_BUF;
+    }
+
+    item->type = type;
+    item->len = len;
+    item->data = out_data;
+
+    msu_avllq_account(q, c, rd_seq);
+    LATENCY_RECORD(q, c, stamp);
+
+    return MSU_AVLLQ_STATUS_OK;
+}
+
+#if MSU_AVLLQ_LATENCY
+static uint64_t msu_avllq_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int msu_avllq_latency_bucket(uint64_t ns)
+{
+    if (ns < LATENCY_LINEAR) {
+        return (int)ns;
+    }
+
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (exp - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+
+    return LATENCY_LINEAR + (exp - LATENCY_SUB_BITS - 1) * (1 << LATENCY_SUB_BITS) + sub;
+}
+
+/* highest value falling into a bucket */
+static uint64_t msu_avllq_latency_bucket_max(int bucket)
+{
+    if (bucket < LATENCY_LINEAR) {
+        return bucket;
+    }
+
+    int exp = (bucket - LATENCY_LINEAR) / (1 << LATENCY_SUB_BITS) + LATENCY_SUB_BITS + 1;
+    uint64_t sub = (bucket - LATENCY_LINEAR) % (1 << LATENCY_SUB_BITS);
+    uint64_t min = ((1 << LATENCY_SUB_BITS) + sub) << (exp - LATENCY_SUB_BITS);
+
+    return min + (UINT64_C(1) << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+/* consumer side, one clock read and one counter store */
+static void msu_avllq_latency_record(msu_avllq_handle_t q, msu_avllq_consumer_t *c, uint64_t stamp)
+{
+    if (!q->track_latency) {
+        return;
+    }
+
+    uint64_t now = msu_avllq_now_ns();
+    int bucket = msu_avllq_latency_bucket(now > stamp ? now - stamp : 0);
+
+    if (c->group) {
+        STAT_ADD_SHARED(c->latency[bucket], 1);
+    } else {
+        STAT_ADD(c->latency[bucket], 1);
+    }
+}
+#endif
+
+/*
+ * keyframe policy: hand out the pinned keyframe, with a reference taken, to a consumer which cannot start
+ * from the window. The consumer goes on skipping to the next keyframe after it.
+ */
+static msu_avllq_buf_t *msu_avllq_pinned_keyframe(msu_avllq_handle_t q, msu_avllq_consumer_t *c, size_t *len)
+{
+    if (!c->need_sync || q->ring_bytes) {
+        return NULL;
+    }
+
+    for (;;) {
+        uint64_t key_seq = atomic_load_explicit(&q->key_seq, memory_order_acquire);
+        msu_avllq_buf_t *buf = atomic_load_explicit(&q->key_buf, memory_order_relaxed);
+        *len = atomic_load_explicit(&q->key_len, memory_order_relaxed);
+
+        if (key_seq == MSU_AVLLQ_INVALID_SEQ) {
+            if (!buf) {
+                return NULL;
+            }
+            /* being replaced */
+            continue;
+        }
+
+        uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+        if (key_seq < c->key_floor || key_seq >= MSU_AVLLQ_OLDEST_SEQ(q, wr_seq)) {
+            /* already seen, or still in the window */
+            return NULL;
+        }
+
+        if (!msu_avllq_buf_try_ref(buf)) {
+            continue;
+        }
+
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&q->key_seq, memory_order_relaxed) != key_seq ||
+            atomic_load_explicit(&q->key_buf, memory_order_relaxed) != buf) {
+            msu_avllq_buf_unref(q, buf);
+            continue;
+        }
 
-    /* to the right of wr_off，the nearest one to wr_off is the slowest consumer */
+        c->key_floor = key_seq + 1;
 
-    uint8_t ret = MSU_AVLLQ_INVALID_OFF;
-    int min_diff = MSU_AVLLQ_MAX_CONSUMER + 1;
-    for (int i = 0; i < MSU_AVLLQ_MAX_CONSUMER; i++) {
+        return buf;
+    }
+}
+
+/*
+ * producer only, wake up the consumers parked in msu_avllq_consume_wait() and signal the drained eventfds.
+ * Only the consumers that asked for it in the notify map are visited, so a commit costs one load per 64
+ * consumers when nobody is waiting.
+ */
+static void msu_avllq_wake_consumers(msu_avllq_handle_t q)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (int w = 0; w < q->map_words; w++) {
+        if (!atomic_load_explicit(&q->notify_map[w], memory_order_relaxed)) {
+            continue;
+        }
 
-        if (q->consumer[i] != -1) {
-            int diff = (int)q->rd_off_local[i] - (int)q->wr_off;
+        uint64_t bits = atomic_exchange_explicit(&q->notify_map[w], 0, memory_order_seq_cst);
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            msu_avllq_consumer_t *c = &q->consumers[i];
+            bits &= bits - 1;
 
-            /* diff == 0， data all fetched， speed is the fastest， we use a big value for compensation */
-            if (diff == 0) {
-                diff = MSU_AVLLQ_MAX_CONSUMER;
-            } else if (diff < 0) {
-                diff += q->capacity;
+            if (atomic_load_explicit(&c->waiting, memory_order_relaxed) &&
+                atomic_exchange_explicit(&c->waiting, 0, memory_order_relaxed)) {
+                syscall(SYS_futex, (uint32_t *)&c->waiting, FUTEX_WAKE_PRIVATE, c->group ? INT_MAX : 1,
+                        NULL, NULL, 0);
             }
 
-            if (diff < min_diff) {
-                min_diff = diff;
-                ret = q->rd_off_local[i];
+            if (!atomic_load_explicit(&c->event_signaled, memory_order_relaxed) && CONSUMER_EXISTS(q, i)) {
+                msu_avllq_event_signal(q, i);
+            }
+        }
+    }
+}
+
+/* consumer side, ask the producer to visit this consumer on the next commit */
+static void msu_avllq_request_notify(msu_avllq_handle_t q, int consumer_index)
+{
+    atomic_fetch_or_explicit(&q->notify_map[MAP_WORD(consumer_index)], MAP_BIT(consumer_index),
+                             memory_order_seq_cst);
+}
+
+/* make the eventfd readable, a no-op if already signaled or not created */
+static void msu_avllq_event_signal(msu_avllq_handle_t q, int consumer_index)
+{
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    int efd = atomic_load_explicit(&c->event_fd, memory_order_relaxed);
+
+    if (efd != -1 && !atomic_exchange_explicit(&c->event_signaled, 1, memory_order_acq_rel)) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+            printf("Failed to signal eventfd: %s\n", strerror(errno));
+        }
+    }
+}
+
+/*
+ * drain the eventfd before dropping the flag: dropping it first lets a producer write in between, the
+ * read then swallows that write and the fd stays unreadable while every later signal sees the flag set.
+ * EAGAIN with the flag set means a producer has set it and its write is still in flight, keep the flag.
+ */
+static void msu_avllq_event_clear(msu_avllq_handle_t q, int consumer_index)
+{
+    msu_avllq_consumer_t *c = &q->consumers[consumer_index];
+    int efd = atomic_load_explicit(&c->event_fd, memory_order_relaxed);
+
+    if (efd == -1 || !atomic_load_explicit(&c->event_signaled, memory_order_acquire)) {
+        return;
+    }
+
+    uint64_t count;
+    if (read(efd, &count, sizeof(count)) != sizeof(count)) {
+        if (errno != EAGAIN) {
+            printf("Failed to clear eventfd: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    atomic_store_explicit(&c->event_signaled, 0, memory_order_seq_cst);
+}
+
+/*
+ * consumer side, keep the eventfd readable exactly while the local ring is non-empty. After clearing,
+ * the ring is checked again: an item published in between may have found the eventfd still signaled.
+ */
+static void msu_avllq_event_sync(msu_avllq_handle_t q, int consumer_index)
+{
+    if (atomic_load_explicit(&q->consumers[consumer_index].event_fd, memory_order_relaxed) == -1) {
+        return;
+    }
+
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+    if (msu_avllq_local_rd_seq(q, consumer_index, wr_seq) == wr_seq) {
+        msu_avllq_event_clear(q, consumer_index);
+        msu_avllq_request_notify(q, consumer_index);
+
+        atomic_thread_fence(memory_order_seq_cst);
+
+        wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+        if (msu_avllq_local_rd_seq(q, consumer_index, wr_seq) == wr_seq) {
+            return;
+        }
+    }
+
+    msu_avllq_event_signal(q, consumer_index);
+}
+
+/*
+ * global read seq: the slowest registered consumer, never older than what deregistered consumers have
+ * read and never older than the oldest item in the window.
+ */
+static uint64_t msu_avllq_global_rd_seq(msu_avllq_handle_t q, uint64_t wr_seq)
+{
+    uint64_t rd_seq = atomic_load_explicit(&q->rd_seq, memory_order_relaxed);
+    uint64_t oldest = MSU_AVLLQ_OLDEST_SEQ(q, wr_seq);
+    uint64_t slowest = msu_avllq_slowest_rd_seq2(q, wr_seq);
+
+    if (rd_seq < oldest) {
+        rd_seq = oldest;
+    }
+
+    return slowest != MSU_AVLLQ_INVALID_SEQ && slowest > rd_seq ? slowest : rd_seq;
+}
+
+/* local read seq of a consumer, items overwritten by producer are skipped */
+static uint64_t msu_avllq_local_rd_seq(msu_avllq_handle_t q, int consumer_index, uint64_t wr_seq)
+{
+    uint64_t rd_seq = atomic_load_explicit(&q->consumers[consumer_index].rd_seq, memory_order_acquire);
+    uint64_t oldest = MSU_AVLLQ_OLDEST_SEQ(q, wr_seq);
+
+    return rd_seq < oldest ? oldest : rd_seq;
+}
+
+/*
+ * a scan of the live consumers. Consume never calls it, the global read seq is derived from it on queries
+ * and registration only, and the lossless producer calls it only when its cached lower bound says full.
+ */
+static uint64_t msu_avllq_slowest_rd_seq2(msu_avllq_handle_t q, uint64_t wr_seq)
+{
+    uint64_t ret = MSU_AVLLQ_INVALID_SEQ;
+
+    for (int w = 0; w < q->map_words; w++) {
+        uint64_t bits = atomic_load_explicit(&q->live_map[w], memory_order_acquire);
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            uint64_t rd_seq = msu_avllq_local_rd_seq(q, i, wr_seq);
+            if (rd_seq < ret) {
+                ret = rd_seq;
             }
         }
     }
 
     return ret;
 }
+
+/* global read seq only moves forward */
+static void msu_avllq_advance_global_rd_seq(msu_avllq_handle_t q, uint64_t seq)
+{
+    uint64_t rd_seq = atomic_load_explicit(&q->rd_seq, memory_order_relaxed);
+
+    while (rd_seq < seq) {
+        if (atomic_compare_exchange_weak_explicit(&q->rd_seq, &rd_seq, seq,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+/*
+ * compare the speed of global read seq and the read seq of a consumer.
+ * return <0, global is slow; =0, equal; >0, global is faster
+ */
+static int msu_avllq_compare_read_speed2(msu_avllq_handle_t q, int consumer_index)
+{
+    assert(CONSUMER_EXISTS(q, consumer_index));
+
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+    uint64_t global = msu_avllq_global_rd_seq(q, wr_seq);
+    uint64_t local = msu_avllq_local_rd_seq(q, consumer_index, wr_seq);
+
+    return (global > local) - (global < local);
+}
+
+int msu_avllq_buf_size(msu_avllq_handle_t q)
+{
+    assert(q != NULL);
+
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+
+    return (int)(wr_seq - msu_avllq_global_rd_seq(q, wr_seq));
+}
+
+int msu_avllq_buf_empty(msu_avllq_handle_t q)
+{
+    assert(q != NULL);
+
+    return msu_avllq_buf_size(q) == 0;
+}
+
+int msu_avllq_buf_full(msu_avllq_handle_t q)
+{
+    assert(q != NULL);
+
+    return (uint64_t)msu_avllq_buf_size(q) == MSU_AVLLQ_WINDOW(q);
+}
+
+int msu_avllq_local_buf_empty(msu_avllq_handle_t q, int consumer_id)
+{
+    assert(q != NULL);
+
+    int idx = msu_avllq_find_consumer_index(q, consumer_id);
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+
+    return msu_avllq_local_rd_seq(q, idx, wr_seq) == wr_seq;
+}
+
+int msu_avllq_local_buf_full(msu_avllq_handle_t q, int consumer_id)
+{
+    assert(q != NULL);
+
+    int idx = msu_avllq_find_consumer_index(q, consumer_id);
+    uint64_t wr_seq = atomic_load_explicit(&q->wr_seq, memory_order_acquire);
+
+    return wr_seq - msu_avllq_local_rd_seq(q, idx, wr_seq) == MSU_AVLLQ_WINDOW(q);
+}
+
+int msu_avllq_compare_read_speed(msu_avllq_handle_t q, int consumer_id)
+{
+    assert(q != NULL);
+
+    int idx = msu_avllq_find_consumer_index(q, consumer_id);
+
+    return msu_avllq_compare_read_speed2(q, idx);
+}
+
+uint64_t msu_avllq_slowest_rd_seq(msu_avllq_handle_t q)
+{
+    assert(q != NULL);
+
+    return msu_avllq_slowest_rd_seq2(q, atomic_load_explicit(&q->wr_seq, memory_order_acquire));
+}
@@ -8,6 +8,14 @@
  *
  * AVLLQ is actually an SPMC (single producer, multiple consumer) queue. It doesn't support inter process
  * communication. The best usage scenario is using AVLLQ to connect producer and consumers in different threads.
+ * Created with config producers > 1 it is MPMC: producers claim items by ticket, fill them in parallel and
+ * publish in ticket order.
+ *
+ * Produce and consume are lock-free: the producer never waits for consumers, a consumer detects that the
+ * item it is copying has been overwritten and retries with a newer one. Only consumer registration takes a lock.
+ *
+ * Every consumer sees every item, unless consumers join a consumer group: the members of a group share one
+ * consumer id and cursor, and each item goes to one of them only. Groups still see the full stream each.
  */
 #ifndef MISCUTIL_AVLLQ_H
 #define MISCUTIL_AVLLQ_H
@@ -15,11 +23,15 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#define MSU_AVLLQ_MAX_CONSUMER         4
-#define MSU_AVLLQ_MAX_CAPACITY         64
+struct iovec;
+
+#define MSU_AVLLQ_MAX_CONSUMER         4        /* default number of consumers */
+#define MSU_AVLLQ_MAX_CONSUMER_LIMIT   65536
+#define MSU_AVLLQ_MAX_CAPACITY         65536
+#define MSU_AVLLQ_MAX_LANES            8
 #define MSU_AVLLQ_MIN_CAPACITY         2
 
-#define MSU_AVLLQ_INVALID_OFF          0xFF
+#define MSU_AVLLQ_INVALID_SEQ          UINT64_MAX
 
 #ifdef __cplusplus
 extern "C"{
@@ -31,34 +43,230 @@ typedef enum msu_avllq_status_e {
     MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND,
     MSU_AVLLQ_STATUS_NO_BUF,
     MSU_AVLLQ_STATUS_MEMORY_ERR,
+    MSU_AVLLQ_STATUS_TIMEOUT,
+    MSU_AVLLQ_STATUS_SPILLED,       /* produced, an unread item was copied aside for a spilling consumer */
+    MSU_AVLLQ_STATUS_TRUNCATED,     /* consumed, the item did not fit into the buffer of the caller */
 } msu_avllq_status_t;
 
+/*
+ * what the producer does with an item a consumer has not read yet when it drops out of the window. A policy
+ * other than drop slows the producer down, and only for the consumers opting in.
+ */
+typedef enum msu_avllq_policy_e {
+    MSU_AVLLQ_POLICY_DROP,          /* the consumer skips it and counts an overrun */
+    MSU_AVLLQ_POLICY_BLOCK,         /* produce waits for the consumer, MSU_AVLLQ_STATUS_TIMEOUT if it is too slow */
+    MSU_AVLLQ_POLICY_SPILL,         /* produce copies it to a list the consumer reads first, MSU_AVLLQ_STATUS_SPILLED */
+} msu_avllq_policy_t;
+
 typedef struct msu_avllq_item_s {
     void       *data;
     size_t      len;
     int         type;
 } msu_avllq_item_t;
 
+typedef struct msu_avllq_config_s {
+    uint32_t    capacity;
+    int         max_item_size;
+    int         max_consumers;      /* 0 means MSU_AVLLQ_MAX_CONSUMER */
+    int         use_slab;           /* 1 backs all preserved buffers by one huge page aligned arena */
+    size_t      ring_bytes;         /* 0 means one max_item_size buffer per item. Otherwise items are packed
+                                       into a byte ring of ring_bytes and the oldest ones are evicted by
+                                       bytes, capacity only bounds the number of items. No borrow. */
+    int         keyframe_policy;    /* 1 makes new and lagging consumers start at a keyframe, the latest
+                                       keyframe stays pinned until a newer one arrives (buffer mode only) */
+    int         keyframe_type;      /* item type marking keyframes */
+    int         track_latency;      /* 1 stamps items on produce and keeps a latency histogram per consumer */
+    int         producers;          /* above 1 enables multi producer mode, up to producers items are filled
+                                       in parallel and capacity - producers items are readable. More producer
+                                       threads are fine, they wait for a ticket. No reserve/commit, no ring */
+    int         lossless;           /* 1 makes produce fail with MSU_AVLLQ_STATUS_NO_BUF instead of overwriting
+                                       items a consumer has not read (single producer, buffer mode only) */
+} msu_avllq_config_t;
+
+/* per consumer options, see msu_avllq_register_consumer2() */
+typedef struct msu_avllq_consumer_config_s {
+    int         group;              /* 0 means the consumer reads on its own, otherwise the consumers registered
+                                       with the same group share one cursor and each item goes to one of them.
+                                       Buffer mode without keyframe policy only */
+    msu_avllq_policy_t  policy;     /* block and spill need a single producer, buffer mode and no keyframe policy.
+                                       Spilling consumers cannot be grouped and cannot borrow. A group has
+                                       the policy of its first member */
+    int64_t     block_timeout_ns;   /* block policy, how long produce waits for the consumer, < 0 forever. 0 never
+                                       waits: while the consumer is a full window behind, produce returns
+                                       MSU_AVLLQ_STATUS_TIMEOUT at once and the item is not produced. The
+                                       timeouts of all blocking consumers run from the same start */
+    uint32_t    spill_limit;        /* spill policy, spilled items not read yet before dropping, 0 means no limit */
+    void     *(*out_alloc)(void *ctx, size_t size);
+                                    /* allocator of the consumed item buffers, e.g. a pool of the caller. NULL
+                                       means the queue keeps a free list of max_item_size buffers per consumer */
+    void      (*out_free)(void *ctx, void *ptr);
+                                    /* set together with out_alloc, registering with only one of them fails */
+    void       *out_ctx;            /* passed to out_alloc and out_free, valid until the last item is released */
+} msu_avllq_consumer_config_t;
+
+/* per consumer statistics */
+typedef struct msu_avllq_stats_s {
+    uint64_t    consumed;           /* items handed out */
+    uint64_t    overrun;            /* items overwritten by the producer before the consumer read them */
+    uint64_t    lag;                /* items published but not read yet */
+    uint64_t    max_lag;            /* largest lag seen when an item was handed out */
+} msu_avllq_stats_t;
+
+/* produce to consume latency of a consumer, percentiles in ns */
+typedef struct msu_avllq_latency_s {
+    uint64_t    count;
+    uint64_t    min_ns;
+    uint64_t    p50_ns;
+    uint64_t    p99_ns;
+    uint64_t    p999_ns;
+    uint64_t    max_ns;
+} msu_avllq_latency_t;
+
+/* one lane of a multi lane queue, see msu_avllq_lanes_create() */
+typedef struct msu_avllq_lane_config_s {
+    int                 type;       /* items of this type are produced into the lane */
+    msu_avllq_config_t  config;     /* capacity, item size and drop policy of the lane */
+} msu_avllq_lane_config_t;
+
 typedef struct msu_avllq_s *msu_avllq_handle_t;
 
-msu_avllq_handle_t msu_avllq_create(uint8_t capacity, int max_item_size);
+typedef struct msu_avllq_lanes_s *msu_avllq_lanes_handle_t;
+
+msu_avllq_handle_t msu_avllq_create(uint32_t capacity, int max_item_size);
+
+msu_avllq_handle_t msu_avllq_create2(const msu_avllq_config_t *config);
 
 void msu_avllq_destroy(msu_avllq_handle_t rb);
 
 int msu_avllq_register_consumer(msu_avllq_handle_t rb);
 
+/*
+ * register with options, config may be NULL. Joining a group that exists returns the consumer id of the group,
+ * every member deregisters it once. Members may consume the id from multiple threads at the same time, with
+ * msu_avllq_consume(), msu_avllq_consume_n() and msu_avllq_consume_wait() only.
+ */
+int msu_avllq_register_consumer2(msu_avllq_handle_t rb, const msu_avllq_consumer_config_t *config);
+
 void msu_avllq_deregister_consumer(msu_avllq_handle_t rb, int consumer_id);
 
-int msu_avllq_enumerate_consumers(msu_avllq_handle_t rb, int consumer_ids[MSU_AVLLQ_MAX_CONSUMER]);
+/* consumer_ids must hold max_consumers entries, MSU_AVLLQ_MAX_CONSUMER for queues made by msu_avllq_create() */
+int msu_avllq_enumerate_consumers(msu_avllq_handle_t rb, int consumer_ids[]);
 
+/*
+ * MSU_AVLLQ_STATUS_NO_BUF means a lossless queue is full and MSU_AVLLQ_STATUS_TIMEOUT that a blocking consumer
+ * did not read in time, the item is not produced. MSU_AVLLQ_STATUS_SPILLED means it is, after spilling.
+ */
 msu_avllq_status_t msu_avllq_produce(msu_avllq_handle_t rb, const msu_avllq_item_t *item);
 
 msu_avllq_status_t msu_avllq_produce2(msu_avllq_handle_t rb, const void *data, size_t len, int type);
 
+/* produce one item gathered from iovcnt buffers, the item is the concatenation of all of them */
+msu_avllq_status_t msu_avllq_producev(msu_avllq_handle_t rb, const struct iovec *iov, int iovcnt, int type);
+
+/* produce n items and wake up the consumers once, stops at the first item not produced */
+msu_avllq_status_t msu_avllq_produce_n(msu_avllq_handle_t rb, const msu_avllq_item_t *items, size_t n);
+
+/*
+ * in place produce: msu_avllq_reserve() returns the buffer of the next item, up to max_item_size bytes,
+ * NULL on failure, if a lossless queue is full or a blocking consumer did not read in time. The item becomes
+ * visible to consumers once msu_avllq_commit() is called. Single producer mode only.
+ */
+void *msu_avllq_reserve(msu_avllq_handle_t rb, size_t len);
+
+msu_avllq_status_t msu_avllq_commit(msu_avllq_handle_t rb, size_t len, int type);
+
 msu_avllq_status_t msu_avllq_consume(msu_avllq_handle_t rb, int consumer_id, msu_avllq_item_t *item);
 
+/*
+ * consume the newest item only, *skipped (may be NULL) is set to the number of older items passed over.
+ * Meant for preview consumers which never need the intermediate items.
+ */
+msu_avllq_status_t msu_avllq_consume_latest(msu_avllq_handle_t rb, int consumer_id, msu_avllq_item_t *item,
+                                            uint64_t *skipped);
+
+/*
+ * consume up to max items, *count is set to the number of items filled in. Each item must be released
+ * with msu_avllq_item_release(). MSU_AVLLQ_STATUS_NO_BUF if there is nothing to consume.
+ */
+msu_avllq_status_t msu_avllq_consume_n(msu_avllq_handle_t rb, int consumer_id, msu_avllq_item_t *items,
+                                       size_t max, size_t *count);
+
+/*
+ * consume the next item into a buffer of the caller, e.g. the input buffer of a decoder, with one copy and no
+ * msu_avllq_item_release(). *len and *type (both may be NULL) are set to the item. An item longer than cap is
+ * consumed all the same, its first cap bytes are copied and MSU_AVLLQ_STATUS_TRUNCATED tells *len is above cap.
+ * A buffer of max_item_size never truncates.
+ */
+msu_avllq_status_t msu_avllq_consume_into(msu_avllq_handle_t rb, int consumer_id, void *dst, size_t cap, size_t *len,
+                                          int *type);
+
+/*
+ * blocking variant of consume, parks the caller until the producer publishes an item or timeout_ns
+ * expires (MSU_AVLLQ_STATUS_TIMEOUT). A negative timeout waits forever. Only the consumers actually
+ * parked are woken up by produce.
+ */
+msu_avllq_status_t msu_avllq_consume_wait(msu_avllq_handle_t rb, int consumer_id, msu_avllq_item_t *item,
+                                          int64_t timeout_ns);
+
+/*
+ * eventfd of a consumer for epoll/poll integration, created on first call and owned by the queue, so the
+ * caller MUST NOT close it. It is readable while the consumer has unread items, and cleared by the consume
+ * calls once the consumer has drained the queue. Returns -1 on failure.
+ */
+int msu_avllq_consumer_fd(msu_avllq_handle_t rb, int consumer_id);
+
+/*
+ * hand a consumed item back, its buffer returns to the free list of the consumer or to out_free. May be called
+ * from any thread, also after the consumer has deregistered or the queue has been destroyed.
+ */
 void msu_avllq_item_release(msu_avllq_item_t const *item);
 
+/* snapshot of the statistics of a consumer, lock-free and callable from any thread */
+msu_avllq_status_t msu_avllq_get_stats(msu_avllq_handle_t rb, int consumer_id, msu_avllq_stats_t *stats);
+
+/*
+ * snapshot of the latency histogram of a consumer since its registration or the last reset, reset != 0
+ * starts a new period. MSU_AVLLQ_STATUS_ERR unless the queue is created with track_latency and the library
+ * is built with MSU_AVLLQ_LATENCY.
+ */
+msu_avllq_status_t msu_avllq_get_latency(msu_avllq_handle_t rb, int consumer_id, msu_avllq_latency_t *latency,
+                                         int reset);
+
+/*
+ * zero copy variant of consume: item->data points into queue memory and stays valid until the item is
+ * handed back by msu_avllq_return(). The data MUST NOT be modified, and MUST NOT be passed to
+ * msu_avllq_item_release(). The producer never overwrites a borrowed item, it switches to a spare buffer.
+ */
+msu_avllq_status_t msu_avllq_borrow(msu_avllq_handle_t rb, int consumer_id, msu_avllq_item_t *item);
+
+void msu_avllq_return(msu_avllq_handle_t rb, msu_avllq_item_t const *item);
+
+/*
+ * Multi lane queue: one queue per item type, e.g. a small lossless lane for audio next to a latest-wins
+ * lane for video, so a burst in one lane never drops items of another. A consumer reads all lanes through
+ * one consumer id, lanes are served in the order they are given, the first lane has the highest priority.
+ */
+msu_avllq_lanes_handle_t msu_avllq_lanes_create(const msu_avllq_lane_config_t *lanes, int nr_lanes);
+
+void msu_avllq_lanes_destroy(msu_avllq_lanes_handle_t lq);
+
+int msu_avllq_lanes_register_consumer(msu_avllq_lanes_handle_t lq);
+
+void msu_avllq_lanes_deregister_consumer(msu_avllq_lanes_handle_t lq, int consumer_id);
+
+/* produce into the lane of type, MSU_AVLLQ_STATUS_ERR if no lane takes the type */
+msu_avllq_status_t msu_avllq_lanes_produce2(msu_avllq_lanes_handle_t lq, const void *data, size_t len, int type);
+
+/* the next item of the first lane having one, release it by msu_avllq_item_release() */
+msu_avllq_status_t msu_avllq_lanes_consume(msu_avllq_lanes_handle_t lq, int consumer_id, msu_avllq_item_t *item);
+
+/* blocking variant of msu_avllq_lanes_consume(), timeout_ns < 0 waits forever */
+msu_avllq_status_t msu_avllq_lanes_consume_wait(msu_avllq_lanes_handle_t lq, int consumer_id, msu_avllq_item_t *item,
+                                                int64_t timeout_ns);
+
+/* the queue of a lane and the consumer id in it, e.g. for msu_avllq_get_stats() */
+msu_avllq_handle_t msu_avllq_lanes_queue(msu_avllq_lanes_handle_t lq, int lane, int consumer_id, int *lane_consumer_id);
+
 int msu_avllq_buf_size(msu_avllq_handle_t rb);
 
 int msu_avllq_buf_empty(msu_avllq_handle_t rb);
@@ -73,7 +281,7 @@ int msu_avllq_local_buf_full(msu_avllq_handle_t rb, int consumer_id);
 
 int msu_avllq_compare_read_speed(msu_avllq_handle_t rb, int consumer_id);
 
-uint8_t msu_avllq_slowest_rd_off(msu_avllq_handle_t rb);
+uint64_t msu_avllq_slowest_rd_seq(msu_avllq_handle_t rb);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,361 @@
+/**
+ * Header-only C++ front end of AVLLQ with compile-time capacity and consumer count.
+ *
+ * msu::avllq<T, Capacity, MaxConsumers> keeps the semantics of the C queue: single producer, multiple consumers,
+ * latest wins, a slow consumer skips the items it has been overrun by. Items are trivially copyable T stored in
+ * place in the slots, instead of a void pointer and length copied into a heap buffer. Capacity must be a power of
+ * two so that a slot index is a mask, and the consumer table is a fixed array the compiler can unroll over.
+ *
+ * Like the C queue, produce and consume are lock-free, a consumer copying an item the producer is overwriting
+ * notices it by the slot seqlock and retries with a newer one. Registration takes no lock either, a consumer
+ * slot is claimed by CAS.
+ */
+#ifndef MISCUTIL_AVLLQ_HPP
+#define MISCUTIL_AVLLQ_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "avllq.h"
+
+namespace msu {
+
+template <typename T, std::size_t Capacity, std::size_t MaxConsumers = MSU_AVLLQ_MAX_CONSUMER>
+class avllq {
+    static_assert(std::is_trivially_copyable<T>::value, "avllq items must be trivially copyable");
+    static_assert(Capacity >= MSU_AVLLQ_MIN_CAPACITY && Capacity <= MSU_AVLLQ_MAX_CAPACITY,
+                  "avllq capacity out of range");
+    static_assert((Capacity & (Capacity - 1)) == 0, "avllq capacity must be a power of two");
+    static_assert(MaxConsumers >= 1 && MaxConsumers <= MSU_AVLLQ_MAX_CONSUMER_LIMIT,
+                  "avllq consumer count out of range");
+
+public:
+    static constexpr std::size_t capacity = Capacity;
+    static constexpr std::size_t max_consumers = MaxConsumers;
+
+    avllq() : wr_seq_(0), rd_seq_(0)
+    {
+        for (std::size_t i = 0; i < Capacity; i++) {
+            slots_[i].seq.store(0, std::memory_order_relaxed);
+        }
+
+        for (std::size_t i = 0; i < MaxConsumers; i++) {
+            consumers_[i].id.store(-1, std::memory_order_relaxed);
+            consumers_[i].rd_seq.store(0, std::memory_order_relaxed);
+            consumers_[i].generation = 0;
+        }
+    }
+
+    avllq(const avllq &) = delete;
+    avllq &operator=(const avllq &) = delete;
+
+    /*
+     * returns the consumer id, -1 if all consumers are taken. Like msu_avllq_register_consumer(), a new consumer
+     * starts at the global read seq: where the slowest live consumer is, never before what deregistered
+     * consumers had read and never before the oldest readable item.
+     */
+    int register_consumer()
+    {
+        for (std::size_t i = 0; i < MaxConsumers; i++) {
+            consumer_t &c = consumers_[i];
+            int expected = -1;
+
+            if (c.id.load(std::memory_order_relaxed) != -1 ||
+                !c.id.compare_exchange_strong(expected, CLAIMED, std::memory_order_acquire)) {
+                continue;
+            }
+
+            c.generation = (c.generation + 1) & GENERATION_MASK;
+            c.rd_seq.store(global_rd_seq(), std::memory_order_relaxed);
+
+            int consumer_id = (int)((c.generation << INDEX_BITS) | i);
+            c.id.store(consumer_id, std::memory_order_release);
+
+            return consumer_id;
+        }
+
+        return -1;
+    }
+
+    msu_avllq_status_t deregister_consumer(int consumer_id)
+    {
+        consumer_t *c = find_consumer(consumer_id);
+        if (!c) {
+            return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+        }
+
+        /* fold the position into the floor, so the global read seq never moves backwards */
+        uint64_t rd_seq = c->rd_seq.load(std::memory_order_relaxed);
+        uint64_t floor = rd_seq_.load(std::memory_order_relaxed);
+        while (floor < rd_seq && !rd_seq_.compare_exchange_weak(floor, rd_seq, std::memory_order_relaxed)) {
+        }
+
+        c->id.store(-1, std::memory_order_release);
+
+        return MSU_AVLLQ_STATUS_OK;
+    }
+
+    /* producer only */
+    msu_avllq_status_t produce(const T &item)
+    {
+        std::memcpy(begin_write(), &item, sizeof(T));
+        end_write();
+
+        return MSU_AVLLQ_STATUS_OK;
+    }
+
+    /* producer only, T is trivially copyable so moving it is a copy, the overload keeps call sites generic */
+    msu_avllq_status_t produce(T &&item)
+    {
+        return produce(static_cast<const T &>(item));
+    }
+
+    /* producer only, construct the item in its slot */
+    template <typename... Args>
+    msu_avllq_status_t emplace(Args &&...args)
+    {
+        ::new (begin_write()) T(std::forward<Args>(args)...);
+        end_write();
+
+        return MSU_AVLLQ_STATUS_OK;
+    }
+
+    /* copy out the next item, NO_BUF if there is nothing new. Items overrun are skipped */
+    msu_avllq_status_t consume(int consumer_id, T &item)
+    {
+        consumer_t *c = find_consumer(consumer_id);
+        if (!c) {
+            return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+        }
+
+        uint64_t cursor = c->rd_seq.load(std::memory_order_relaxed);
+        msu_avllq_status_t status = copy_next(cursor, item) ? MSU_AVLLQ_STATUS_OK : MSU_AVLLQ_STATUS_NO_BUF;
+
+        c->rd_seq.store(cursor, std::memory_order_release);
+
+        return status;
+    }
+
+    /* move-aware consume, the item is moved into out only when one was read */
+    msu_avllq_status_t consume(int consumer_id, T *out)
+    {
+        T item;
+        msu_avllq_status_t status = consume(consumer_id, item);
+        if (status == MSU_AVLLQ_STATUS_OK) {
+            *out = std::move(item);
+        }
+
+        return status;
+    }
+
+    /* copy out up to max items in order, the cursor is stored once */
+    msu_avllq_status_t consume_n(int consumer_id, T *items, std::size_t max, std::size_t *count)
+    {
+        *count = 0;
+
+        consumer_t *c = find_consumer(consumer_id);
+        if (!c) {
+            return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+        }
+
+        uint64_t cursor = c->rd_seq.load(std::memory_order_relaxed);
+        while (*count < max && copy_next(cursor, items[*count])) {
+            (*count)++;
+        }
+
+        c->rd_seq.store(cursor, std::memory_order_release);
+
+        return *count ? MSU_AVLLQ_STATUS_OK : MSU_AVLLQ_STATUS_NO_BUF;
+    }
+
+    /* copy out the newest item only, skipped counts the older unread items passed over */
+    msu_avllq_status_t consume_latest(int consumer_id, T &item, uint64_t *skipped)
+    {
+        consumer_t *c = find_consumer(consumer_id);
+        if (!c) {
+            return MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND;
+        }
+
+        uint64_t cursor = c->rd_seq.load(std::memory_order_relaxed);
+        uint64_t from = cursor;
+        msu_avllq_status_t status = MSU_AVLLQ_STATUS_NO_BUF;
+
+        for (;;) {
+            uint64_t wr_seq = wr_seq_.load(std::memory_order_acquire);
+            if (cursor >= wr_seq) {
+                break;
+            }
+
+            cursor = wr_seq - 1;
+            if (copy_next(cursor, item)) {
+                status = MSU_AVLLQ_STATUS_OK;
+                break;
+            }
+        }
+
+        if (skipped) {
+            *skipped = status == MSU_AVLLQ_STATUS_OK ? cursor - 1 - from : 0;
+        }
+
+        c->rd_seq.store(cursor, std::memory_order_release);
+
+        return status;
+    }
+
+    /* number of readable items for the consumer, 0 if the consumer is not found */
+    std::size_t buf_size(int consumer_id)
+    {
+        consumer_t *c = find_consumer(consumer_id);
+        if (!c) {
+            return 0;
+        }
+
+        uint64_t wr_seq = wr_seq_.load(std::memory_order_acquire);
+        uint64_t cursor = c->rd_seq.load(std::memory_order_relaxed);
+        uint64_t oldest = oldest_seq(wr_seq);
+
+        return (std::size_t)(wr_seq - (cursor < oldest ? oldest : cursor));
+    }
+
+    bool empty(int consumer_id)
+    {
+        return buf_size(consumer_id) == 0;
+    }
+
+    /* read seq of the slowest live consumer, the write seq if there is none */
+    uint64_t slowest_rd_seq()
+    {
+        uint64_t wr_seq = wr_seq_.load(std::memory_order_acquire);
+        uint64_t slowest = wr_seq;
+
+        for (std::size_t i = 0; i < MaxConsumers; i++) {
+            if (consumers_[i].id.load(std::memory_order_acquire) >= 0) {
+                uint64_t rd_seq = consumers_[i].rd_seq.load(std::memory_order_acquire);
+                slowest = rd_seq < slowest ? rd_seq : slowest;
+            }
+        }
+
+        uint64_t oldest = oldest_seq(wr_seq);
+
+        return slowest < oldest ? oldest : slowest;
+    }
+
+private:
+    static constexpr int INDEX_BITS = 16;
+    static constexpr uint64_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static constexpr uint32_t GENERATION_MASK = 0x7fff;
+    static constexpr int CLAIMED = -2;
+    static constexpr uint64_t MASK = Capacity - 1;
+    /* the slot at the write seq is being rewritten, so one slot less than capacity is readable */
+    static constexpr uint64_t WINDOW = Capacity - 1;
+
+    static constexpr uint64_t seqlock_writing(uint64_t seq) { return 2 * seq + 1; }
+    static constexpr uint64_t seqlock_published(uint64_t seq) { return 2 * seq + 2; }
+    static constexpr uint64_t oldest_seq(uint64_t wr_seq) { return wr_seq > WINDOW ? wr_seq - WINDOW : 0; }
+
+    struct alignas(64) slot_t {
+        std::atomic<uint64_t>   seq;                /* seqlock, odd while being written */
+        alignas(alignof(T)) unsigned char data[sizeof(T)];
+    };
+
+    struct alignas(64) consumer_t {
+        std::atomic<int>        id;                 /* -1 if free */
+        std::atomic<uint64_t>   rd_seq;             /* next seq to read, only the consumer moves it */
+        uint32_t                generation;
+    };
+
+    uint64_t global_rd_seq()
+    {
+        uint64_t wr_seq = wr_seq_.load(std::memory_order_acquire);
+        uint64_t rd_seq = rd_seq_.load(std::memory_order_relaxed);
+        uint64_t oldest = oldest_seq(wr_seq);
+        uint64_t slowest = UINT64_MAX;
+
+        for (std::size_t i = 0; i < MaxConsumers; i++) {
+            if (consumers_[i].id.load(std::memory_order_acquire) >= 0) {
+                uint64_t seq = consumers_[i].rd_seq.load(std::memory_order_acquire);
+                slowest = seq < slowest ? seq : slowest;
+            }
+        }
+
+        rd_seq = rd_seq < oldest ? oldest : rd_seq;
+
+        return slowest != UINT64_MAX && slowest > rd_seq ? slowest : rd_seq;
+    }
+
+    consumer_t *find_consumer(int consumer_id)
+    {
+        if (consumer_id < 0 || (consumer_id & INDEX_MASK) >= MaxConsumers) {
+            return nullptr;
+        }
+
+        consumer_t *c = &consumers_[consumer_id & INDEX_MASK];
+
+        return c->id.load(std::memory_order_acquire) == consumer_id ? c : nullptr;
+    }
+
+    /* mark the slot at the write seq so that a consumer still copying the old item retries */
+    void *begin_write()
+    {
+        uint64_t wr_seq = wr_seq_.load(std::memory_order_relaxed);
+        slot_t &slot = slots_[wr_seq & MASK];
+
+        slot.seq.store(seqlock_writing(wr_seq), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        return slot.data;
+    }
+
+    void end_write()
+    {
+        uint64_t wr_seq = wr_seq_.load(std::memory_order_relaxed);
+
+        slots_[wr_seq & MASK].seq.store(seqlock_published(wr_seq), std::memory_order_release);
+        wr_seq_.store(wr_seq + 1, std::memory_order_release);
+    }
+
+    /* copy the item at or after cursor and move cursor past it, false if everything has been read */
+    bool copy_next(uint64_t &cursor, T &item)
+    {
+        for (;;) {
+            uint64_t wr_seq = wr_seq_.load(std::memory_order_acquire);
+            uint64_t oldest = oldest_seq(wr_seq);
+
+            if (cursor < oldest) {
+                cursor = oldest;
+            }
+
+            if (cursor == wr_seq) {
+                return false;
+            }
+
+            slot_t &slot = slots_[cursor & MASK];
+
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == seqlock_published(cursor)) {
+                std::memcpy(&item, slot.data, sizeof(T));
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                    cursor++;
+                    return true;
+                }
+            }
+
+            /* overwritten by producer, the window has moved on */
+        }
+    }
+
+    alignas(64) std::atomic<uint64_t> wr_seq_;
+    alignas(64) std::atomic<uint64_t> rd_seq_;  /* global read seq left by deregistered consumers */
+    slot_t slots_[Capacity];
+    consumer_t consumers_[MaxConsumers];
+};
+
+} // namespace msu
+
+#endif // MISCUTIL_AVLLQ_HPP
@@ -0,0 +1,295 @@
+/**
+ * avllq throughput and latency benchmark.
+ *
+ * Sweeps item size, capacity, consumer count and produce rate, and prints one JSON array with a record
+ * per configuration: produce rate, per consumer throughput, drop rate and latency percentiles.
+ *
+ * usage: bench_avllq [--sizes=64,4096,...] [--capacities=8,64] [--consumers=1,2,4] [--rates=0,1000]
+ *                    [--duration-ms=500] [--max-mem-mb=1024] [--borrow] [--latency]
+ *
+ * A rate of 0 produces as fast as possible, otherwise it is in items per second. 0 consumers measures the
+ * produce path alone, e.g. --consumers=0 --capacities=63,64 compares modulo and mask slot indexing.
+ * Configurations needing more than max-mem-mb of item buffers are skipped. Lists take up to 16 values.
+ * --borrow reads with msu_avllq_borrow() and parks on the consumer eventfd, so no item is copied.
+ * --latency turns on the in-queue latency histograms. It costs two clock reads per item, so it is off for
+ * the throughput sweep and every record says whether it was on.
+ *
+ * Contention: sweep --consumers=1,2,4,8 on a machine with that many free cores, once as built and once with
+ * avllq.c compiled with -DMSU_AVLLQ_CACHE_LINE=8, which packs producer and consumer state together again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include "avllq.h"
+
+#define BENCH_MAX_LIST          16
+#define BENCH_MAX_CONSUMERS     64
+#define BENCH_WAIT_NS           10000000
+
+typedef struct bench_list_s {
+    uint64_t    values[BENCH_MAX_LIST];
+    int         count;
+} bench_list_t;
+
+typedef struct bench_consumer_s {
+    msu_avllq_handle_t  q;
+    int                 consumer_id;
+    int                 borrow;
+    int                 fd;             /* readiness of a borrowing consumer, -1 otherwise */
+    atomic_int         *stop;
+    uint64_t            items;
+    uint64_t            bytes;
+    pthread_t           thread;
+} bench_consumer_t;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_parse_u64(const char *arg, uint64_t *value)
+{
+    char *end;
+
+    *value = strtoull(arg, &end, 10);
+
+    return end == arg || *end != '\0' ? -1 : 0;
+}
+
+static int bench_parse_list(const char *arg, bench_list_t *list)
+{
+    char *end;
+
+    list->count = 0;
+    while (*arg) {
+        if (list->count == BENCH_MAX_LIST) {
+            return -1;
+        }
+        list->values[list->count++] = strtoull(arg, &end, 10);
+        if (end == arg || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        arg = *end == ',' ? end + 1 : end;
+    }
+
+    return list->count > 0 ? 0 : -1;
+}
+
+static void *bench_consumer_thread(void *arg)
+{
+    bench_consumer_t *c = (bench_consumer_t *)arg;
+    msu_avllq_item_t item;
+
+    while (!atomic_load_explicit(c->stop, memory_order_relaxed)) {
+        if (c->borrow) {
+            if (msu_avllq_borrow(c->q, c->consumer_id, &item) != MSU_AVLLQ_STATUS_OK) {
+                /* borrow has no blocking variant, park on the eventfd without consuming and borrow again */
+                struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+                poll(&pfd, 1, BENCH_WAIT_NS / 1000000);
+                continue;
+            }
+            msu_avllq_return(c->q, &item);
+        } else {
+            if (msu_avllq_consume_wait(c->q, c->consumer_id, &item, BENCH_WAIT_NS) != MSU_AVLLQ_STATUS_OK) {
+                continue;
+            }
+            msu_avllq_item_release(&item);
+        }
+
+        c->items++;
+        c->bytes += item.len;
+    }
+
+    return NULL;
+}
+
+static int bench_run(uint64_t item_size, uint64_t capacity, int consumers, uint64_t rate, uint64_t duration_ms,
+                     int borrow, int track_latency, int first)
+{
+    msu_avllq_config_t config = {
+        .capacity = (uint32_t)capacity,
+        .max_item_size = (int)item_size,
+        .max_consumers = consumers,
+        .track_latency = track_latency,
+    };
+    bench_consumer_t c[BENCH_MAX_CONSUMERS];
+    atomic_int stop = 0;
+
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    if (!q) {
+        fprintf(stderr, "Failed to create avllq, size %llu capacity %llu\n",
+                (unsigned long long)item_size, (unsigned long long)capacity);
+        return -1;
+    }
+
+    uint8_t *src = (uint8_t *)malloc(item_size);
+    if (!src) {
+        msu_avllq_destroy(q);
+        return -1;
+    }
+    memset(src, 0x5a, item_size);
+
+    for (int i = 0; i < consumers; i++) {
+        c[i].q = q;
+        c[i].consumer_id = msu_avllq_register_consumer(q);
+        c[i].borrow = borrow;
+        c[i].fd = borrow ? msu_avllq_consumer_fd(q, c[i].consumer_id) : -1;
+        c[i].stop = &stop;
+        c[i].items = 0;
+        c[i].bytes = 0;
+        pthread_create(&c[i].thread, NULL, bench_consumer_thread, &c[i]);
+    }
+
+    uint64_t produced = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t deadline = start + duration_ms * 1000000;
+    uint64_t now = start;
+
+    while (now < deadline) {
+        if (msu_avllq_produce2(q, src, item_size, 0) == MSU_AVLLQ_STATUS_OK) {
+            produced++;
+        }
+
+        if (rate) {
+            uint64_t next = start + produced * 1000000000 / rate;
+            struct timespec ts = { .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        now = bench_now_ns();
+    }
+
+    double seconds = (now - start) / 1e9;
+
+    /* take the numbers before stopping, the consumers are still registered */
+    msu_avllq_stats_t stats[BENCH_MAX_CONSUMERS];
+    msu_avllq_latency_t latency[BENCH_MAX_CONSUMERS];
+    for (int i = 0; i < consumers; i++) {
+        msu_avllq_get_stats(q, c[i].consumer_id, &stats[i]);
+        if (!track_latency || msu_avllq_get_latency(q, c[i].consumer_id, &latency[i], 0) != MSU_AVLLQ_STATUS_OK) {
+            memset(&latency[i], 0, sizeof(latency[i]));
+        }
+    }
+
+    atomic_store(&stop, 1);
+    for (int i = 0; i < consumers; i++) {
+        pthread_join(c[i].thread, NULL);
+    }
+
+    printf("%s  {\"item_size\": %llu, \"capacity\": %llu, \"consumers\": %d, \"rate\": %llu, "
+           "\"mode\": \"%s\", \"track_latency\": %s, \"seconds\": %.3f,\n",
+           first ? "" : ",\n", (unsigned long long)item_size, (unsigned long long)capacity, consumers,
+           (unsigned long long)rate, borrow ? "borrow" : "consume", track_latency ? "true" : "false", seconds);
+    printf("   \"produced\": %llu, \"produce_items_per_s\": %.0f, \"produce_bytes_per_s\": %.0f,\n",
+           (unsigned long long)produced, produced / seconds, produced * (double)item_size / seconds);
+    printf("   \"consumer_stats\": [");
+
+    for (int i = 0; i < consumers; i++) {
+        uint64_t seen = stats[i].consumed + stats[i].overrun;
+        printf("%s\n    {\"consumed\": %llu, \"overrun\": %llu, \"drop_rate\": %.4f, "
+               "\"items_per_s\": %.0f, \"bytes_per_s\": %.0f, \"max_lag\": %llu,\n"
+               "     \"latency_ns\": {\"count\": %llu, \"min\": %llu, \"p50\": %llu, \"p99\": %llu, "
+               "\"p999\": %llu, \"max\": %llu}}",
+               i ? "," : "", (unsigned long long)stats[i].consumed, (unsigned long long)stats[i].overrun,
+               seen ? (double)stats[i].overrun / seen : 0.0, c[i].items / seconds, c[i].bytes / seconds,
+               (unsigned long long)stats[i].max_lag, (unsigned long long)latency[i].count,
+               (unsigned long long)latency[i].min_ns, (unsigned long long)latency[i].p50_ns,
+               (unsigned long long)latency[i].p99_ns, (unsigned long long)latency[i].p999_ns,
+               (unsigned long long)latency[i].max_ns);
+    }
+    printf("]}");
+    fflush(stdout);
+
+    for (int i = 0; i < consumers; i++) {
+        msu_avllq_deregister_consumer(q, c[i].consumer_id);
+    }
+
+    free(src);
+    msu_avllq_destroy(q);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_list_t sizes = { { 64, 4096, 65536, 1048576, 8388608 }, 5 };
+    bench_list_t capacities = { { 8, 64 }, 2 };
+    bench_list_t consumers = { { 1, 2, 4 }, 3 };
+    bench_list_t rates = { { 0 }, 1 };
+    uint64_t duration_ms = 500;
+    uint64_t max_mem_mb = 1024;
+    int borrow = 0;
+    int track_latency = 0;
+
+    for (int i = 1; i < argc; i++) {
+        int ret = 0;
+
+        if (strncmp(argv[i], "--sizes=", 8) == 0) {
+            ret = bench_parse_list(argv[i] + 8, &sizes);
+        } else if (strncmp(argv[i], "--capacities=", 13) == 0) {
+            ret = bench_parse_list(argv[i] + 13, &capacities);
+        } else if (strncmp(argv[i], "--consumers=", 12) == 0) {
+            ret = bench_parse_list(argv[i] + 12, &consumers);
+        } else if (strncmp(argv[i], "--rates=", 8) == 0) {
+            ret = bench_parse_list(argv[i] + 8, &rates);
+        } else if (strncmp(argv[i], "--duration-ms=", 14) == 0) {
+            ret = bench_parse_u64(argv[i] + 14, &duration_ms);
+        } else if (strncmp(argv[i], "--max-mem-mb=", 13) == 0) {
+            ret = bench_parse_u64(argv[i] + 13, &max_mem_mb);
+        } else if (strcmp(argv[i], "--borrow") == 0) {
+            borrow = 1;
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            track_latency = 1;
+        } else {
+            ret = -1;
+        }
+
+        if (ret != 0) {
+            fprintf(stderr, "Illegal argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    /* everything is checked before the first line of output, a failed run never leaves half a JSON array */
+    for (int n = 0; n < consumers.count; n++) {
+        if (consumers.values[n] > BENCH_MAX_CONSUMERS) {
+            fprintf(stderr, "Illegal consumer count %llu\n", (unsigned long long)consumers.values[n]);
+            return 1;
+        }
+    }
+
+    int first = 1;
+
+    printf("[\n");
+
+    for (int s = 0; s < sizes.count; s++) {
+        for (int c = 0; c < capacities.count; c++) {
+            if (sizes.values[s] * capacities.values[c] > max_mem_mb * 1024 * 1024) {
+                fprintf(stderr, "Skip item size %llu capacity %llu, above max-mem-mb\n",
+                        (unsigned long long)sizes.values[s], (unsigned long long)capacities.values[c]);
+                continue;
+            }
+
+            for (int n = 0; n < consumers.count; n++) {
+                for (int r = 0; r < rates.count; r++) {
+                    if (bench_run(sizes.values[s], capacities.values[c], (int)consumers.values[n],
+                                  rates.values[r], duration_ms, borrow, track_latency, first) == 0) {
+                        first = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("\n]\n");
+
+    return 0;
+}
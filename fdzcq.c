@@ -36,6 +36,7 @@ typedef struct msu_fdzcq_s {
     void                       *shm_data;                           /* the data in shm, including head */
     int                         shm_fd;
     int                         map_len;
+    uint8_t                     capacity_mask;                      /* capacity - 1 if a power of two, else 0 */
     msu_fdbuf_release_func_t    fdbuf_free_cb;                      /* callback to free fd */
     int                         consumer[MSU_FDZCQ_MAX_CONSUMER];   /* consumers for this q instance */
     int                         is_producer;                        /* producer or consumer */
@@ -54,16 +55,23 @@ typedef struct msu_fdzcq_s {
 #define MSU_FDZCQ_SHM_DATA_PTR(Q)           ((msu_fdbuf_t *)((uint8_t *)((Q)->shm_data) + MSU_FDZCQ_SHM_HEAD_SIZE))
 #define MSU_FDZCQ_INVALID_OFF               0xFF
 
-#define MSU_FDZCQ_BUF_SIZE(H)               ( ((H)->wr_off + (H)->capacity - (H)->rd_off) % ((H)->capacity) )
+/*
+ * a power of two capacity is detected when the shm is mapped, offsets then wrap with the mask kept in the
+ * process local handle instead of a division
+ */
+#define MSU_FDZCQ_CAPACITY_MASK(C)          ( ((C) & ((C) - 1)) == 0 ? (C) - 1 : 0 )
+#define MSU_FDZCQ_WRAP(Q, H, X)             ( (Q)->capacity_mask ? (X) & (Q)->capacity_mask : (X) % (H)->capacity )
+
+#define MSU_FDZCQ_BUF_SIZE(Q, H)            MSU_FDZCQ_WRAP((Q), (H), (H)->wr_off + (H)->capacity - (H)->rd_off)
 #define MSU_FDZCQ_IS_GLOBAL_EMPTY(H)        ( (H)->wr_off == (H)->rd_off )
-#define MSU_FDZCQ_IS_GLOBAL_FULL(H)         ( ((H)->wr_off + 1) % (H)->capacity == (H)->rd_off )
+#define MSU_FDZCQ_IS_GLOBAL_FULL(Q, H)      ( MSU_FDZCQ_WRAP((Q), (H), (H)->wr_off + 1) == (H)->rd_off )
 #define MSU_FDZCQ_IS_LOCAL_EMPTY(H, I)      ( (H)->wr_off == (H)->rd_off_local[(I)] )
-#define MSU_FDZCQ_IS_LOCAL_FULL(H, I)       ( ((H)->wr_off + 1) % (H)->capacity == (H)->rd_off_local[(I)] )
+#define MSU_FDZCQ_IS_LOCAL_FULL(Q, H, I)    ( MSU_FDZCQ_WRAP((Q), (H), (H)->wr_off + 1) == (H)->rd_off_local[(I)] )
 
-#define NEXT_OFFSET(H, OFF)                 ( ((OFF) + 1) % (H)->capacity )
-#define ADVANCE_WR_OFF(H)                   ( (H)->wr_off = ((H)->wr_off + 1) % (H)->capacity )
-#define ADVANCE_GLOBAL_RD_OFFSET(H)         ( (H)->rd_off = ((H)->rd_off + 1) % (H)->capacity )
-#define ADVANCE_LOCAL_RD_OFFSET(H, I)       ( (H)->rd_off_local[(I)] = ((H)->rd_off_local[(I)] + 1) % (H)->capacity )
+#define NEXT_OFFSET(Q, H, OFF)              MSU_FDZCQ_WRAP((Q), (H), (OFF) + 1)
+#define ADVANCE_WR_OFF(Q, H)                ( (H)->wr_off = MSU_FDZCQ_WRAP((Q), (H), (H)->wr_off + 1) )
+#define ADVANCE_GLOBAL_RD_OFFSET(Q, H)      ( (H)->rd_off = MSU_FDZCQ_WRAP((Q), (H), (H)->rd_off + 1) )
+#define ADVANCE_LOCAL_RD_OFFSET(Q, H, I)    ( (H)->rd_off_local[(I)] = MSU_FDZCQ_WRAP((Q), (H), (H)->rd_off_local[(I)] + 1) )
 
 #define CONSUMER_EXISTS(H, I)               ( (H)->consumer[(I)] != -1 )
 
@@ -185,6 +193,7 @@ msu_fdzcq_handle_t msu_fdzcq_create(uint8_t capacity, msu_fdbuf_release_func_t f
 
     msu_fdzcq_shm_head_t *head = (msu_fdzcq_shm_head_t *)q->shm_data;
     head->capacity = capacity;
+    q->capacity_mask = MSU_FDZCQ_CAPACITY_MASK(capacity);
 
     memset(head->consumer, -1, sizeof(head->consumer));
 
@@ -298,6 +307,8 @@ msu_fdzcq_handle_t msu_fdzcq_acquire(msu_fdbuf_release_func_t free_cb, void *use
         return NULL;
     }
 
+    q->capacity_mask = MSU_FDZCQ_CAPACITY_MASK(MSU_FDZCQ_SHM_HEAD_PTR(q)->capacity);
+
     return q;
 }
 
@@ -425,28 +436,28 @@ msu_fdzcq_status_t msu_fdzcq_produce2(msu_fdzcq_handle_t q, int fd, int data[MSU
     bufs[head->wr_off].ext_data     = ext_data;
     memcpy(bufs[head->wr_off].data, data, MSU_FDZCQ_MAX_DATA * sizeof(int));
 
-    if (MSU_FDZCQ_IS_GLOBAL_FULL(head)) {
+    if (MSU_FDZCQ_IS_GLOBAL_FULL(q, head)) {
         sem_post(&head->q_sem);
-        msu_fdbuf_t *next_buf = &bufs[NEXT_OFFSET(head, head->wr_off)];
+        msu_fdbuf_t *next_buf = &bufs[NEXT_OFFSET(q, head, head->wr_off)];
         msu_fdbuf_unref(q, next_buf);
         sem_wait(&head->q_sem);
     }
 
     /* update write ptr */
-    ADVANCE_WR_OFF(head);
+    ADVANCE_WR_OFF(q, head);
 
     /*
      * update write ptr may lead to equal write and read ptr, which means the queue is empty,
      * so we need to update read ptr accordingly. In this case, consumer will miss a buffer
      */
     if (head->rd_off == head->wr_off) {
-        ADVANCE_GLOBAL_RD_OFFSET(head);
+        ADVANCE_GLOBAL_RD_OFFSET(q, head);
     }
 
     /* update local read ptr as well */
     for (int i = 0; i < MSU_FDZCQ_MAX_CONSUMER; i++) {
         if (head->consumer[i] != -1 && head->rd_off_local[i] == head->wr_off) {
-            ADVANCE_LOCAL_RD_OFFSET(head, i);
+            ADVANCE_LOCAL_RD_OFFSET(q, head, i);
         }
     }
 
@@ -656,7 +667,7 @@ msu_fdzcq_status_t msu_fdzcq_consume(msu_fdzcq_handle_t q, int consumer_id, msu_
     bufs[rd_off_local].ref_count++;
     *fdbuf = &bufs[rd_off_local];
 
-    ADVANCE_LOCAL_RD_OFFSET(head, consumer_index);
+    ADVANCE_LOCAL_RD_OFFSET(q, head, consumer_index);
 
     /* calculate the number of local read ptrs which are faster than global read ptr */
     int consumer_count = 0;
@@ -761,7 +772,7 @@ int msu_fdzcq_size(msu_fdzcq_handle_t q)
     msu_fdzcq_shm_head_t *head = MSU_FDZCQ_SHM_HEAD_PTR(q);
 
     sem_wait(&head->q_sem);
-    int sz = MSU_FDZCQ_BUF_SIZE(head);
+    int sz = MSU_FDZCQ_BUF_SIZE(q, head);
     sem_post(&head->q_sem);
 
     return sz;
@@ -787,7 +798,7 @@ int msu_fdzcq_full(msu_fdzcq_handle_t q)
     msu_fdzcq_shm_head_t *head = MSU_FDZCQ_SHM_HEAD_PTR(q);
 
     sem_wait(&head->q_sem);
-    int full = MSU_FDZCQ_IS_GLOBAL_FULL(head);
+    int full = MSU_FDZCQ_IS_GLOBAL_FULL(q, head);
     sem_post(&head->q_sem);
 
     return full;
@@ -819,7 +830,7 @@ static int msu_fdzcq_local_buf_full(msu_fdzcq_handle_t q, int consumer_id)
 
     msu_fdzcq_shm_head_t *head = MSU_FDZCQ_SHM_HEAD_PTR(q);
 
-    return MSU_FDZCQ_IS_LOCAL_FULL(head, idx);
+    return MSU_FDZCQ_IS_LOCAL_FULL(q, head, idx);
 }
 
 static int msu_fdzcq_compare_read_speed(msu_fdzcq_handle_t q, int consumer_id)
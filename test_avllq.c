@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <locale.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/uio.h>
 #include <glib.h>
 #include "avllq.h"
 
@@ -645,6 +648,1750 @@ static void test_avllq_no_producer_buf_malloc()
     g_assert_true(TRUE);
 }
 
+#define LOCKFREE_TEST_ITEMS          20000
+#define LOCKFREE_TEST_ITEM_WORDS     256
+
+static gpointer test_avllq_mt_lockfree_overwrite_producer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    while (g_atomic_int_get(&pcd->start_flag) < 2) {
+        usleep(1000);
+    }
+
+    uint32_t buf[LOCKFREE_TEST_ITEM_WORDS];
+    for (uint32_t i = 1; i <= LOCKFREE_TEST_ITEMS; i++) {
+        for (int j = 0; j < LOCKFREE_TEST_ITEM_WORDS; j++) {
+            buf[j] = i;
+        }
+        g_assert_true(msu_avllq_produce2(pcd->q, buf, sizeof(buf), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    return NULL;
+}
+
+static gpointer test_avllq_mt_lockfree_overwrite_consumer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    int consumer_id = msu_avllq_register_consumer(pcd->q);
+    g_assert_true(consumer_id >= 0);
+
+    g_atomic_int_inc(&pcd->start_flag);
+
+    msu_avllq_item_t item;
+    uint32_t last = 0;
+
+    while (last < LOCKFREE_TEST_ITEMS) {
+        if (msu_avllq_consume(pcd->q, consumer_id, &item) != MSU_AVLLQ_STATUS_OK) {
+            continue;
+        }
+
+        g_assert_cmpint(item.len, ==, LOCKFREE_TEST_ITEM_WORDS * sizeof(uint32_t));
+
+        /* never torn, never out of order */
+        uint32_t *words = (uint32_t *)item.data;
+        for (int j = 1; j < LOCKFREE_TEST_ITEM_WORDS; j++) {
+            g_assert_cmpint(words[j], ==, words[0]);
+        }
+        g_assert_cmpint(words[0], >, last);
+        last = words[0];
+
+        msu_avllq_item_release(&item);
+    }
+
+    msu_avllq_deregister_consumer(pcd->q, consumer_id);
+
+    return NULL;
+}
+
+static void test_avllq_mt_lockfree_overwrite()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, LOCKFREE_TEST_ITEM_WORDS * sizeof(uint32_t));
+
+    struct producer_consumer_data_t data;
+    data.q = q;
+    data.start_flag = 0;
+
+    GThread *producer_thread = g_thread_new("producer", test_avllq_mt_lockfree_overwrite_producer, &data);
+    GThread *consumer_thread1 = g_thread_new("consumer1", test_avllq_mt_lockfree_overwrite_consumer, &data);
+    GThread *consumer_thread2 = g_thread_new("consumer2", test_avllq_mt_lockfree_overwrite_consumer, &data);
+
+    g_thread_join(producer_thread);
+    g_thread_join(consumer_thread1);
+    g_thread_join(consumer_thread2);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_borrow_and_return()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, 1000);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    char data[256];
+    msu_avllq_item_t borrowed;
+    msu_avllq_item_t item;
+
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &borrowed) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    sprintf(data, "producer #0");
+    g_assert_true(msu_avllq_produce2(q, data, strlen(data), 3) == MSU_AVLLQ_STATUS_OK);
+
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &borrowed) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(borrowed.len, ==, strlen("producer #0"));
+    g_assert_cmpint(borrowed.type, ==, 3);
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 0);
+
+    /* wrap around the ring several times, the borrowed item must survive */
+    for (int i = 1; i < 10; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_cmpint(memcmp(borrowed.data, "producer #0", borrowed.len), ==, 0);
+
+    /* the latest 3 items are readable as usual */
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(memcmp(item.data, "producer #7", item.len), ==, 0);
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(memcmp(item.data, "producer #8", item.len), ==, 0);
+    msu_avllq_return(q, &item);
+
+    msu_avllq_return(q, &borrowed);
+
+    /* returned buffers are recycled */
+    for (int i = 10; i < 20; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(memcmp(item.data, "producer #17", item.len), ==, 0);
+    msu_avllq_return(q, &item);
+
+    msu_avllq_destroy(q);
+}
+
+static gpointer test_avllq_mt_borrow_while_overwrite_consumer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    int consumer_id = msu_avllq_register_consumer(pcd->q);
+    g_assert_true(consumer_id >= 0);
+
+    g_atomic_int_inc(&pcd->start_flag);
+
+    msu_avllq_item_t item;
+    uint32_t last = 0;
+
+    while (last < LOCKFREE_TEST_ITEMS) {
+        if (msu_avllq_borrow(pcd->q, consumer_id, &item) != MSU_AVLLQ_STATUS_OK) {
+            continue;
+        }
+
+        g_assert_cmpint(item.len, ==, LOCKFREE_TEST_ITEM_WORDS * sizeof(uint32_t));
+
+        /* hold the item while the producer keeps going, it must not change under us */
+        uint32_t *words = (uint32_t *)item.data;
+        g_assert_cmpint(words[0], >, last);
+        last = words[0];
+
+        for (int round = 0; round < 3; round++) {
+            for (int j = 0; j < LOCKFREE_TEST_ITEM_WORDS; j++) {
+                g_assert_cmpint(words[j], ==, last);
+            }
+        }
+
+        msu_avllq_return(pcd->q, &item);
+    }
+
+    msu_avllq_deregister_consumer(pcd->q, consumer_id);
+
+    return NULL;
+}
+
+static void test_avllq_mt_borrow_while_overwrite()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, LOCKFREE_TEST_ITEM_WORDS * sizeof(uint32_t));
+
+    struct producer_consumer_data_t data;
+    data.q = q;
+    data.start_flag = 0;
+
+    GThread *producer_thread = g_thread_new("producer", test_avllq_mt_lockfree_overwrite_producer, &data);
+    GThread *consumer_thread1 = g_thread_new("consumer1", test_avllq_mt_borrow_while_overwrite_consumer, &data);
+    GThread *consumer_thread2 = g_thread_new("consumer2", test_avllq_mt_borrow_while_overwrite_consumer, &data);
+
+    g_thread_join(producer_thread);
+    g_thread_join(consumer_thread1);
+    g_thread_join(consumer_thread2);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_reserve_and_commit()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, 1000);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    msu_avllq_item_t item;
+
+    g_assert_null(msu_avllq_reserve(q, 1001));
+    g_assert_true(msu_avllq_commit(q, 10, 0) == MSU_AVLLQ_STATUS_ERR);
+
+    for (int i = 0; i < 10; i++) {
+        char *buf = (char *)msu_avllq_reserve(q, 1000);
+        g_assert_nonnull(buf);
+
+        int len = sprintf(buf, "producer #%d", i);
+
+        /* not visible before commit */
+        g_assert_cmpint(msu_avllq_buf_size(q), ==, i < 3 ? i : 3);
+
+        g_assert_true(msu_avllq_commit(q, len, i) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 3);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(item.len, ==, strlen("producer #7"));
+    g_assert_cmpint(item.type, ==, 7);
+    g_assert_cmpint(memcmp(item.data, "producer #7", item.len), ==, 0);
+    msu_avllq_item_release(&item);
+
+    /* a pending reservation is invisible to consumers */
+    char *buf = (char *)msu_avllq_reserve(q, 16);
+    g_assert_nonnull(buf);
+    g_assert_true(msu_avllq_reserve(q, 16) == buf);
+    sprintf(buf, "producer #10");
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    g_assert_true(msu_avllq_commit(q, strlen(buf), 10) == MSU_AVLLQ_STATUS_OK);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(memcmp(item.data, "producer #10", item.len), ==, 0);
+    msu_avllq_item_release(&item);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_consume_wait_timeout()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, 1000);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    msu_avllq_item_t item;
+
+    gint64 start = g_get_monotonic_time();
+    g_assert_true(msu_avllq_consume_wait(q, consumer_id, &item, 20 * 1000 * 1000) == MSU_AVLLQ_STATUS_TIMEOUT);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 20 * 1000);
+
+    g_assert_true(msu_avllq_consume_wait(q, consumer_id, &item, 0) == MSU_AVLLQ_STATUS_TIMEOUT);
+
+    const char *data = "some data";
+    g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+
+    /* available at once, no wait */
+    g_assert_true(msu_avllq_consume_wait(q, consumer_id, &item, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(memcmp(item.data, data, item.len), ==, 0);
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_consume_wait(q, consumer_id + 100, &item, 0) == MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    msu_avllq_destroy(q);
+}
+
+static gpointer test_avllq_mt_consume_wait_producer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    while (g_atomic_int_get(&pcd->start_flag) < 2) {
+        usleep(1000);
+    }
+
+    char buf[16];
+    for (int i = 0; i < 20; i++) {
+        usleep(2000);
+        sprintf(buf, "data #%d", i);
+        g_assert_true(msu_avllq_produce2(pcd->q, buf, strlen(buf), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    return NULL;
+}
+
+static gpointer test_avllq_mt_consume_wait_consumer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    int consumer_id = msu_avllq_register_consumer(pcd->q);
+
+    g_atomic_int_inc(&pcd->start_flag);
+
+    msu_avllq_item_t item;
+    char buf[16];
+
+    /* producer is slower than consumer, every item arrives in order without polling */
+    for (int i = 0; i < 20; i++) {
+        g_assert_true(msu_avllq_consume_wait(pcd->q, consumer_id, &item, -1) == MSU_AVLLQ_STATUS_OK);
+
+        sprintf(buf, "data #%d", i);
+        g_assert_cmpint(item.len, ==, strlen(buf));
+        g_assert_cmpint(memcmp(item.data, buf, item.len), ==, 0);
+        msu_avllq_item_release(&item);
+    }
+
+    msu_avllq_deregister_consumer(pcd->q, consumer_id);
+
+    return NULL;
+}
+
+static void test_avllq_mt_consume_wait()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 1000);
+
+    struct producer_consumer_data_t data;
+    data.q = q;
+    data.start_flag = 0;
+
+    GThread *producer_thread = g_thread_new("producer", test_avllq_mt_consume_wait_producer, &data);
+    GThread *consumer_thread1 = g_thread_new("consumer1", test_avllq_mt_consume_wait_consumer, &data);
+    GThread *consumer_thread2 = g_thread_new("consumer2", test_avllq_mt_consume_wait_consumer, &data);
+
+    g_thread_join(producer_thread);
+    g_thread_join(consumer_thread1);
+    g_thread_join(consumer_thread2);
+
+    msu_avllq_destroy(q);
+}
+
+static int test_avllq_fd_readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_avllq_st_consumer_fd()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, 1000);
+
+    int consumer_id1 = msu_avllq_register_consumer(q);
+    int consumer_id2 = msu_avllq_register_consumer(q);
+
+    g_assert_cmpint(msu_avllq_consumer_fd(q, consumer_id1 + 100), ==, -1);
+
+    int fd1 = msu_avllq_consumer_fd(q, consumer_id1);
+    int fd2 = msu_avllq_consumer_fd(q, consumer_id2);
+    g_assert_true(fd1 >= 0);
+    g_assert_true(fd2 >= 0);
+    g_assert_cmpint(msu_avllq_consumer_fd(q, consumer_id1), ==, fd1);
+
+    g_assert_false(test_avllq_fd_readable(fd1));
+    g_assert_false(test_avllq_fd_readable(fd2));
+
+    char data[256];
+    msu_avllq_item_t item;
+
+    sprintf(data, "producer #0");
+    g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    sprintf(data, "producer #1");
+    g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+
+    g_assert_true(test_avllq_fd_readable(fd1));
+    g_assert_true(test_avllq_fd_readable(fd2));
+
+    /* stays readable until drained */
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+    g_assert_true(test_avllq_fd_readable(fd1));
+
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+    g_assert_false(test_avllq_fd_readable(fd1));
+
+    /* consumer 2 is independent */
+    g_assert_true(test_avllq_fd_readable(fd2));
+    g_assert_true(msu_avllq_borrow(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_return(q, &item);
+    g_assert_true(msu_avllq_borrow(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_return(q, &item);
+    g_assert_false(test_avllq_fd_readable(fd2));
+
+    /* created on a consumer with pending items, readable at once */
+    sprintf(data, "producer #2");
+    g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    int consumer_id3 = msu_avllq_register_consumer(q);
+    int fd3 = msu_avllq_consumer_fd(q, consumer_id3);
+    g_assert_true(fd3 >= 0);
+    g_assert_true(test_avllq_fd_readable(fd3));
+
+    msu_avllq_destroy(q);
+}
+
+#define TEST_AVLLQ_FD_ITEMS 200000
+
+static gpointer test_avllq_mt_consumer_fd_producer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    while (g_atomic_int_get(&pcd->start_flag) < 1) {
+        usleep(1000);
+    }
+
+    for (int i = 0; i < TEST_AVLLQ_FD_ITEMS; i++) {
+        g_assert_true(msu_avllq_produce2(pcd->q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+        if (i % 64 == 0) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static gpointer test_avllq_mt_consumer_fd_consumer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    int consumer_id = msu_avllq_register_consumer(pcd->q);
+    struct pollfd pfd = { .fd = msu_avllq_consumer_fd(pcd->q, consumer_id), .events = POLLIN };
+    g_assert_true(pfd.fd >= 0);
+
+    g_atomic_int_inc(&pcd->start_flag);
+
+    /*
+     * level-triggered loop taking one item per wakeup while the producer commits, the fd has to stay
+     * readable for as long as an item is pending or poll times out
+     */
+    msu_avllq_item_t item;
+    int last = -1;
+    while (last != TEST_AVLLQ_FD_ITEMS - 1) {
+        g_assert_cmpint(poll(&pfd, 1, 5000), ==, 1);
+
+        if (msu_avllq_consume(pcd->q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK) {
+            g_assert_cmpint(item.len, ==, sizeof(int));
+            int value;
+            memcpy(&value, item.data, sizeof(value));
+            g_assert_cmpint(value, >, last);
+            last = value;
+            msu_avllq_item_release(&item);
+        }
+    }
+
+    msu_avllq_deregister_consumer(pcd->q, consumer_id);
+
+    return NULL;
+}
+
+static void test_avllq_mt_consumer_fd()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 16);
+
+    struct producer_consumer_data_t data;
+    data.q = q;
+    data.start_flag = 0;
+
+    GThread *producer_thread = g_thread_new("producer", test_avllq_mt_consumer_fd_producer, &data);
+    GThread *consumer_thread = g_thread_new("consumer", test_avllq_mt_consumer_fd_consumer, &data);
+
+    g_thread_join(producer_thread);
+    g_thread_join(consumer_thread);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_large_capacity_and_read_seq()
+{
+    msu_avllq_handle_t q = msu_avllq_create(1000, 64);
+    g_assert_nonnull(q);
+
+    g_assert_true(msu_avllq_slowest_rd_seq(q) == MSU_AVLLQ_INVALID_SEQ);
+
+    int consumer_id1 = msu_avllq_register_consumer(q);
+    int consumer_id2 = msu_avllq_register_consumer(q);
+
+    char data[64];
+    msu_avllq_item_t item;
+
+    for (int i = 0; i < 1500; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 999);
+    g_assert_true(msu_avllq_buf_full(q));
+    g_assert_true(msu_avllq_local_buf_full(q, consumer_id1));
+
+    /* both consumers lost the first 501 items */
+    g_assert_cmpuint(msu_avllq_slowest_rd_seq(q), ==, 501);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(memcmp(item.data, "producer #501", item.len), ==, 0);
+    msu_avllq_item_release(&item);
+
+    /* consumer 1 is ahead, the global read seq stays with consumer 2 */
+    g_assert_cmpint(msu_avllq_compare_read_speed(q, consumer_id1), <, 0);
+    g_assert_cmpint(msu_avllq_compare_read_speed(q, consumer_id2), ==, 0);
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 999);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+
+    g_assert_cmpuint(msu_avllq_slowest_rd_seq(q), ==, 502);
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 998);
+
+    /* consumer 2 leaves behind consumer 1, nothing changes */
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+    msu_avllq_deregister_consumer(q, consumer_id2);
+
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 997);
+
+    msu_avllq_deregister_consumer(q, consumer_id1);
+
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 997);
+    g_assert_true(msu_avllq_slowest_rd_seq(q) == MSU_AVLLQ_INVALID_SEQ);
+
+    g_assert_null(msu_avllq_create(MSU_AVLLQ_MAX_CAPACITY + 1, 64));
+
+    msu_avllq_destroy(q);
+}
+
+#define MANY_CONSUMERS 200
+
+static void test_avllq_st_many_consumers()
+{
+    msu_avllq_config_t config = { .capacity = 8, .max_item_size = 64, .max_consumers = MANY_CONSUMERS };
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    int consumer_ids[MANY_CONSUMERS];
+    int enumerated[MANY_CONSUMERS];
+    char data[64];
+    msu_avllq_item_t item;
+
+    for (int i = 0; i < MANY_CONSUMERS; i++) {
+        consumer_ids[i] = msu_avllq_register_consumer(q);
+        g_assert_cmpint(consumer_ids[i], !=, -1);
+    }
+    g_assert_cmpint(msu_avllq_register_consumer(q), ==, -1);
+    g_assert_cmpint(msu_avllq_enumerate_consumers(q, enumerated), ==, MANY_CONSUMERS);
+
+    for (int i = 0; i < 3; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    /* every consumer but the last one reads everything, the last one holds the global read seq */
+    for (int i = 0; i < MANY_CONSUMERS - 1; i++) {
+        for (int j = 0; j < 3; j++) {
+            g_assert_true(msu_avllq_consume(q, consumer_ids[i], &item) == MSU_AVLLQ_STATUS_OK);
+            sprintf(data, "producer #%d", j);
+            g_assert_cmpint(memcmp(item.data, data, item.len), ==, 0);
+            msu_avllq_item_release(&item);
+        }
+        g_assert_true(msu_avllq_consume(q, consumer_ids[i], &item) == MSU_AVLLQ_STATUS_NO_BUF);
+    }
+
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 3);
+    msu_avllq_deregister_consumer(q, consumer_ids[MANY_CONSUMERS - 1]);
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 0);
+
+    /* a stale id of a reused entry is not found */
+    int reused_id = msu_avllq_register_consumer(q);
+    g_assert_cmpint(reused_id, !=, -1);
+    g_assert_cmpint(reused_id, !=, consumer_ids[MANY_CONSUMERS - 1]);
+    g_assert_true(msu_avllq_consume(q, consumer_ids[MANY_CONSUMERS - 1], &item) ==
+                  MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+    g_assert_true(msu_avllq_consume(q, reused_id, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    msu_avllq_destroy(q);
+
+    config.max_consumers = MSU_AVLLQ_MAX_CONSUMER_LIMIT + 1;
+    g_assert_null(msu_avllq_create2(&config));
+}
+
+static void test_avllq_st_produce_n_and_consume_n()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 64);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    char data[10][64];
+    msu_avllq_item_t items[10];
+    size_t count;
+
+    for (int i = 0; i < 10; i++) {
+        sprintf(data[i], "producer #%d", i);
+        items[i].data = data[i];
+        items[i].len = strlen(data[i]);
+        items[i].type = i;
+    }
+
+    g_assert_true(msu_avllq_consume_n(q, consumer_id, items, 10, &count) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_cmpuint(count, ==, 0);
+
+    g_assert_true(msu_avllq_produce_n(q, items, 3) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 3);
+
+    msu_avllq_item_t out[10];
+    g_assert_true(msu_avllq_consume_n(q, consumer_id, out, 2, &count) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(count, ==, 2);
+    for (int i = 0; i < 2; i++) {
+        g_assert_cmpint(out[i].type, ==, i);
+        g_assert_cmpint(memcmp(out[i].data, data[i], out[i].len), ==, 0);
+        msu_avllq_item_release(&out[i]);
+    }
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 1);
+
+    /* a batch larger than the window, only the latest 7 items survive */
+    g_assert_true(msu_avllq_produce_n(q, items, 10) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_consume_n(q, consumer_id, out, 10, &count) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(count, ==, 7);
+    for (int i = 0; i < 7; i++) {
+        g_assert_cmpint(out[i].type, ==, i + 3);
+        g_assert_cmpint(memcmp(out[i].data, data[i + 3], out[i].len), ==, 0);
+        msu_avllq_item_release(&out[i]);
+    }
+    g_assert_true(msu_avllq_buf_empty(q));
+
+    /* an oversized item stops the batch, the items before it are published */
+    char big[65] = { 0 };
+    items[1].data = big;
+    items[1].len = sizeof(big);
+    g_assert_true(msu_avllq_produce_n(q, items, 3) == MSU_AVLLQ_STATUS_ERR);
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 1);
+
+    g_assert_true(msu_avllq_consume_n(q, consumer_id + 100, out, 10, &count) ==
+                  MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_producev()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, 16);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    char header[] = "hdr:";
+    char payload[] = "payload";
+    char side[] = "+sd";
+    struct iovec iov[3] = {
+        { .iov_base = header, .iov_len = strlen(header) },
+        { .iov_base = payload, .iov_len = strlen(payload) },
+        { .iov_base = side, .iov_len = strlen(side) },
+    };
+    msu_avllq_item_t item;
+
+    g_assert_true(msu_avllq_producev(q, iov, 3, 7) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(item.type, ==, 7);
+    g_assert_cmpuint(item.len, ==, strlen("hdr:payload+sd"));
+    g_assert_cmpint(memcmp(item.data, "hdr:payload+sd", item.len), ==, 0);
+    msu_avllq_item_release(&item);
+
+    /* 4 + 7 + 7 exceeds the max item size */
+    iov[2] = iov[1];
+    g_assert_true(msu_avllq_producev(q, iov, 3, 7) == MSU_AVLLQ_STATUS_ERR);
+    g_assert_true(msu_avllq_buf_empty(q));
+
+    /* 4 + (SIZE_MAX - 1) wraps to 2, must not pass as a small item */
+    iov[1].iov_len = SIZE_MAX - 1;
+    g_assert_true(msu_avllq_producev(q, iov, 2, 7) == MSU_AVLLQ_STATUS_ERR);
+    g_assert_true(msu_avllq_buf_empty(q));
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_slab()
+{
+    msu_avllq_config_t config = { .capacity = 16, .max_item_size = 1000, .use_slab = 1 };
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    char data[64];
+    msu_avllq_item_t item, borrowed;
+
+    for (int i = 0; i < 40; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+
+        g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpuint((uintptr_t)item.data % 64, ==, 0);
+        g_assert_cmpint(memcmp(item.data, data, item.len), ==, 0);
+        msu_avllq_return(q, &item);
+    }
+
+    /* a pinned slab buffer is replaced by a heap one, both are released on destroy */
+    g_assert_true(msu_avllq_produce2(q, "pinned", 6, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &borrowed) == MSU_AVLLQ_STATUS_OK);
+    for (int i = 0; i < 40; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+    g_assert_cmpint(memcmp(borrowed.data, "pinned", borrowed.len), ==, 0);
+
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint((uintptr_t)item.data % 64, ==, 0);
+    msu_avllq_return(q, &item);
+    msu_avllq_return(q, &borrowed);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_byte_ring()
+{
+    msu_avllq_config_t config = { .capacity = 64, .max_item_size = 1000, .ring_bytes = 2048 };
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    uint8_t data[1000];
+    msu_avllq_item_t item;
+
+    /* small items, many more than fit in the ring by bytes but fewer than the capacity */
+    for (int i = 0; i < 20; i++) {
+        memset(data, i, sizeof(data));
+        g_assert_true(msu_avllq_produce2(q, data, 300, i) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    /* the oldest items are evicted by bytes, the latest ones survive in order */
+    int expected = -1;
+    int count = 0;
+    while (msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK) {
+        if (expected == -1) {
+            expected = item.type;
+        }
+        g_assert_cmpint(item.type, ==, expected++);
+        g_assert_cmpuint(item.len, ==, 300);
+        g_assert_cmpint(((uint8_t *)item.data)[0], ==, item.type);
+        g_assert_cmpint(((uint8_t *)item.data)[299], ==, item.type);
+        msu_avllq_item_release(&item);
+        count++;
+    }
+    g_assert_cmpint(expected, ==, 20);
+    g_assert_cmpint(count, >=, 2048 / 320 - 1);
+    g_assert_cmpint(count, <=, 2048 / 300);
+
+    /* a large item evicts everything before it */
+    g_assert_true(msu_avllq_produce2(q, data, 100, 100) == MSU_AVLLQ_STATUS_OK);
+    memset(data, 0xab, sizeof(data));
+    g_assert_true(msu_avllq_produce2(q, data, 1000, 101) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_produce2(q, data, 10, 102) == MSU_AVLLQ_STATUS_OK);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    if (item.type == 100) {
+        msu_avllq_item_release(&item);
+        g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    }
+    g_assert_cmpint(item.type, ==, 101);
+    g_assert_cmpuint(item.len, ==, 1000);
+    g_assert_cmpint(((uint8_t *)item.data)[999], ==, 0xab);
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(item.type, ==, 102);
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_produce2(q, data, 1001, 0) == MSU_AVLLQ_STATUS_ERR);
+
+    g_assert_true(msu_avllq_produce2(q, data, 10, 103) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_ERR);
+
+    msu_avllq_destroy(q);
+
+    config.ring_bytes = 999;
+    g_assert_null(msu_avllq_create2(&config));
+}
+
+#define KEYFRAME 1
+#define PFRAME 0
+
+static void test_avllq_produce_frame(msu_avllq_handle_t q, int seq, int type)
+{
+    char data[64];
+    sprintf(data, "%s #%d", type == KEYFRAME ? "key" : "p", seq);
+    g_assert_true(msu_avllq_produce2(q, data, strlen(data) + 1, type) == MSU_AVLLQ_STATUS_OK);
+}
+
+static void test_avllq_st_keyframe_policy()
+{
+    msu_avllq_config_t config = { .capacity = 8, .max_item_size = 64, .keyframe_policy = 1, .keyframe_type = KEYFRAME };
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    msu_avllq_item_t item;
+    int seq = 0;
+
+    /* no keyframe yet, a consumer skips everything up to the first one */
+    int consumer_id1 = msu_avllq_register_consumer(q);
+    test_avllq_produce_frame(q, seq++, PFRAME);
+    test_avllq_produce_frame(q, seq++, PFRAME);
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_true(msu_avllq_local_buf_empty(q, consumer_id1));
+
+    test_avllq_produce_frame(q, seq++, KEYFRAME);
+    test_avllq_produce_frame(q, seq++, PFRAME);
+    test_avllq_produce_frame(q, seq++, PFRAME);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "key #2");
+    msu_avllq_item_release(&item);
+
+    /* joining mid-stream starts at the latest keyframe in the window */
+    int consumer_id2 = msu_avllq_register_consumer(q);
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "key #2");
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "p #3");
+    msu_avllq_item_release(&item);
+
+    /* consumer 1 falls behind, the keyframe is overwritten in the window but stays pinned */
+    for (int i = 0; i < 20; i++) {
+        test_avllq_produce_frame(q, seq++, PFRAME);
+    }
+
+    /* it has seen the pinned keyframe already, the P frames are not decodable, wait for the next keyframe */
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    /* a new consumer borrows the pinned keyframe */
+    int consumer_id3 = msu_avllq_register_consumer(q);
+    g_assert_true(msu_avllq_borrow(q, consumer_id3, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "key #2");
+    g_assert_true(msu_avllq_borrow(q, consumer_id3, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    /* the items between the pinned keyframe and the window were gone before it joined, no overrun */
+    msu_avllq_stats_t stats;
+    g_assert_true(msu_avllq_get_stats(q, consumer_id3, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.overrun, ==, 0);
+
+    test_avllq_produce_frame(q, seq++, KEYFRAME);
+    test_avllq_produce_frame(q, seq++, PFRAME);
+    for (int i = 0; i < 8; i++) {
+        test_avllq_produce_frame(q, seq++, PFRAME);
+    }
+    g_assert_cmpstr(item.data, ==, "key #2");
+    msu_avllq_return(q, &item);
+
+    /* consumer 1 lags again, the newer keyframe replaced the pinned one */
+    g_assert_true(msu_avllq_consume(q, consumer_id1, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "key #25");
+    msu_avllq_item_release(&item);
+
+    /* consumer 2 lags as well, it gets the keyframe once only */
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "key #25");
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    /* back in sync, every item is delivered */
+    test_avllq_produce_frame(q, seq++, KEYFRAME);
+    test_avllq_produce_frame(q, seq++, PFRAME);
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "key #35");
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id2, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "p #36");
+    msu_avllq_item_release(&item);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_consume_latest()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 64);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    char data[64];
+    msu_avllq_item_t item;
+    uint64_t skipped;
+
+    g_assert_true(msu_avllq_consume_latest(q, consumer_id, &item, &skipped) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_cmpuint(skipped, ==, 0);
+
+    for (int i = 0; i < 5; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data) + 1, i) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_true(msu_avllq_consume_latest(q, consumer_id, &item, &skipped) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "producer #4");
+    g_assert_cmpuint(skipped, ==, 4);
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_local_buf_empty(q, consumer_id));
+
+    /* nothing to skip */
+    g_assert_true(msu_avllq_produce2(q, "next", 5, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_consume_latest(q, consumer_id, &item, &skipped) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "next");
+    g_assert_cmpuint(skipped, ==, 0);
+    msu_avllq_item_release(&item);
+
+    /* overwritten items are counted as skipped too */
+    for (int i = 0; i < 20; i++) {
+        sprintf(data, "producer #%d", i);
+        g_assert_true(msu_avllq_produce2(q, data, strlen(data) + 1, i) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_true(msu_avllq_consume_latest(q, consumer_id, &item, NULL) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "producer #19");
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_produce2(q, "a", 2, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_produce2(q, "b", 2, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_consume_latest(q, consumer_id, &item, &skipped) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(item.data, ==, "b");
+    g_assert_cmpuint(skipped, ==, 1);
+    msu_avllq_item_release(&item);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_consumer_stats()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 64);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    msu_avllq_item_t item;
+    msu_avllq_stats_t stats;
+
+    g_assert_true(msu_avllq_get_stats(q, consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(stats.consumed, ==, 0);
+    g_assert_cmpuint(stats.overrun, ==, 0);
+    g_assert_cmpuint(stats.lag, ==, 0);
+    g_assert_cmpuint(stats.max_lag, ==, 0);
+
+    for (int i = 0; i < 3; i++) {
+        g_assert_true(msu_avllq_produce2(q, "abc", 3, 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_true(msu_avllq_get_stats(q, consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(stats.lag, ==, 3);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_get_stats(q, consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(stats.consumed, ==, 1);
+    g_assert_cmpuint(stats.lag, ==, 2);
+    g_assert_cmpuint(stats.max_lag, ==, 3);
+
+    /* 2 unread + 20 new items, only the latest 7 fit in the window */
+    for (int i = 0; i < 20; i++) {
+        g_assert_true(msu_avllq_produce2(q, "abc", 3, 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    /* the overrun shows up before the consumer notices it */
+    g_assert_true(msu_avllq_get_stats(q, consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(stats.overrun, ==, 15);
+    g_assert_cmpuint(stats.lag, ==, 7);
+
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_return(q, &item);
+
+    g_assert_true(msu_avllq_get_stats(q, consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(stats.consumed, ==, 2);
+    g_assert_cmpuint(stats.overrun, ==, 15);
+    g_assert_cmpuint(stats.lag, ==, 6);
+    g_assert_cmpuint(stats.max_lag, ==, 7);
+
+    g_assert_true(msu_avllq_get_stats(q, consumer_id + 100, &stats) == MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    msu_avllq_destroy(q);
+}
+
+static void test_avllq_st_latency_histogram()
+{
+    msu_avllq_config_t config = { .capacity = 8, .max_item_size = 64, .track_latency = 1 };
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+
+    msu_avllq_item_t item;
+    msu_avllq_latency_t latency;
+
+    for (int i = 0; i < 100; i++) {
+        g_assert_true(msu_avllq_produce2(q, "abc", 3, 0) == MSU_AVLLQ_STATUS_OK);
+        g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+        msu_avllq_item_release(&item);
+    }
+
+#if !defined(MSU_AVLLQ_LATENCY) || MSU_AVLLQ_LATENCY
+    g_assert_true(msu_avllq_get_latency(q, consumer_id, &latency, 1) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(latency.count, ==, 100);
+    g_assert_cmpuint(latency.min_ns, <=, latency.p50_ns);
+    g_assert_cmpuint(latency.p50_ns, <=, latency.p99_ns);
+    g_assert_cmpuint(latency.p99_ns, <=, latency.p999_ns);
+    g_assert_cmpuint(latency.p999_ns, <=, latency.max_ns);
+    g_assert_cmpuint(latency.max_ns, <, 1000000000);
+
+    /* reset starts over */
+    g_assert_true(msu_avllq_get_latency(q, consumer_id, &latency, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(latency.count, ==, 0);
+
+    g_assert_true(msu_avllq_produce2(q, "abc", 3, 0) == MSU_AVLLQ_STATUS_OK);
+    usleep(2000);
+    g_assert_true(msu_avllq_borrow(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_return(q, &item);
+
+    g_assert_true(msu_avllq_get_latency(q, consumer_id, &latency, 0) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpuint(latency.count, ==, 1);
+    g_assert_cmpuint(latency.p50_ns, >=, 2000000);
+    g_assert_cmpuint(latency.min_ns, ==, latency.max_ns);
+#else
+    g_assert_true(msu_avllq_get_latency(q, consumer_id, &latency, 0) == MSU_AVLLQ_STATUS_ERR);
+#endif
+
+    g_assert_true(msu_avllq_get_latency(q, consumer_id + 100, &latency, 0) != MSU_AVLLQ_STATUS_OK);
+
+    msu_avllq_destroy(q);
+
+    /* not enabled for the queue */
+    q = msu_avllq_create(8, 64);
+    consumer_id = msu_avllq_register_consumer(q);
+    g_assert_true(msu_avllq_get_latency(q, consumer_id, &latency, 0) == MSU_AVLLQ_STATUS_ERR);
+    msu_avllq_destroy(q);
+}
+
+#define MP_PRODUCERS            3
+#define MP_ITEMS_PER_PRODUCER   20000
+#define MP_ITEM_WORDS           64
+
+struct mp_producer_data_t {
+    struct producer_consumer_data_t    *pcd;
+    uint32_t                            producer;
+};
+
+static gpointer test_avllq_mt_multi_producer_producer(gpointer data)
+{
+    struct mp_producer_data_t *mpd = (struct mp_producer_data_t *)data;
+
+    while (g_atomic_int_get(&mpd->pcd->start_flag) < 2) {
+        usleep(1000);
+    }
+
+    /* word 0 is the producer, the others its own item counter */
+    uint32_t buf[MP_ITEM_WORDS];
+    buf[0] = mpd->producer;
+    for (uint32_t i = 1; i <= MP_ITEMS_PER_PRODUCER; i++) {
+        for (int j = 1; j < MP_ITEM_WORDS; j++) {
+            buf[j] = i;
+        }
+        g_assert_true(msu_avllq_produce2(mpd->pcd->q, buf, sizeof(buf), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_atomic_int_inc(&mpd->pcd->start_flag);
+
+    return NULL;
+}
+
+static gpointer test_avllq_mt_multi_producer_consumer(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+
+    int consumer_id = msu_avllq_register_consumer(pcd->q);
+    g_assert_true(consumer_id >= 0);
+
+    msu_avllq_item_t item;
+    uint32_t last[MP_PRODUCERS] = { 0 };
+
+    /* skip what is left of the single threaded part */
+    while (msu_avllq_consume(pcd->q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK) {
+        msu_avllq_item_release(&item);
+    }
+
+    g_atomic_int_inc(&pcd->start_flag);
+
+    /* the last items of a producer may be overrun by the others, stop once all are done and drained */
+    for (;;) {
+        int finished = g_atomic_int_get(&pcd->start_flag) == 2 + MP_PRODUCERS;
+        if (msu_avllq_consume_wait(pcd->q, consumer_id, &item, 10000000) != MSU_AVLLQ_STATUS_OK) {
+            if (finished) {
+                break;
+            }
+            continue;
+        }
+
+        g_assert_cmpint(item.len, ==, MP_ITEM_WORDS * sizeof(uint32_t));
+
+        /* never torn, in order per producer */
+        uint32_t *words = (uint32_t *)item.data;
+        g_assert_cmpint(words[0], <, MP_PRODUCERS);
+        for (int j = 2; j < MP_ITEM_WORDS; j++) {
+            g_assert_cmpint(words[j], ==, words[1]);
+        }
+        g_assert_cmpint(words[1], >, last[words[0]]);
+        last[words[0]] = words[1];
+
+        msu_avllq_item_release(&item);
+    }
+
+    msu_avllq_deregister_consumer(pcd->q, consumer_id);
+
+    return NULL;
+}
+
+static void test_avllq_mt_multi_producer()
+{
+    msu_avllq_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.capacity = 16;
+    config.max_item_size = MP_ITEM_WORDS * sizeof(uint32_t);
+    config.producers = MP_PRODUCERS;
+
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+    uint32_t buf[MP_ITEM_WORDS] = { 0 };
+    msu_avllq_item_t item;
+
+    /* an empty item must not be published as a given up ticket, the batch stops in front of it */
+    msu_avllq_item_t items[3] = {
+        { .data = buf, .len = sizeof(buf), .type = 1 },
+        { .data = buf, .len = 0, .type = 2 },
+        { .data = buf, .len = sizeof(buf), .type = 3 },
+    };
+    g_assert_true(msu_avllq_produce_n(q, items, 3) == MSU_AVLLQ_STATUS_ERR);
+    items[1].data = NULL;
+    items[1].len = sizeof(buf);
+    g_assert_true(msu_avllq_produce_n(q, &items[1], 2) == MSU_AVLLQ_STATUS_ERR);
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(item.type, ==, 1);
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    /* one slot per producer is kept out of the window, no reserve */
+    for (int i = 0; i < 20; i++) {
+        g_assert_true(msu_avllq_produce2(q, buf, sizeof(buf), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+    g_assert_cmpint(msu_avllq_buf_size(q), ==, 16 - MP_PRODUCERS);
+    g_assert_true(msu_avllq_local_buf_full(q, consumer_id));
+    g_assert_null(msu_avllq_reserve(q, sizeof(buf)));
+    msu_avllq_deregister_consumer(q, consumer_id);
+
+    struct producer_consumer_data_t data;
+    data.q = q;
+    data.start_flag = 0;
+
+    struct mp_producer_data_t mpd[MP_PRODUCERS];
+    GThread *producer_thread[MP_PRODUCERS];
+    for (int i = 0; i < MP_PRODUCERS; i++) {
+        mpd[i].pcd = &data;
+        mpd[i].producer = i;
+        producer_thread[i] = g_thread_new("producer", test_avllq_mt_multi_producer_producer, &mpd[i]);
+    }
+
+    GThread *consumer_thread1 = g_thread_new("consumer1", test_avllq_mt_multi_producer_consumer, &data);
+    GThread *consumer_thread2 = g_thread_new("consumer2", test_avllq_mt_multi_producer_consumer, &data);
+
+    for (int i = 0; i < MP_PRODUCERS; i++) {
+        g_thread_join(producer_thread[i]);
+    }
+    g_thread_join(consumer_thread1);
+    g_thread_join(consumer_thread2);
+
+    msu_avllq_destroy(q);
+
+    /* the window must leave room for every producer */
+    config.producers = 16;
+    g_assert_null(msu_avllq_create2(&config));
+}
+
+#define AUDIO   1
+#define VIDEO   2
+
+static void test_avllq_st_lanes()
+{
+    msu_avllq_lane_config_t lanes[2];
+    memset(lanes, 0, sizeof(lanes));
+
+    /* tiny lossless audio lane first, it has the priority */
+    lanes[0].type = AUDIO;
+    lanes[0].config.capacity = 4;
+    lanes[0].config.max_item_size = 64;
+    lanes[0].config.lossless = 1;
+    lanes[1].type = VIDEO;
+    lanes[1].config.capacity = 4;
+    lanes[1].config.max_item_size = 4096;
+
+    msu_avllq_lanes_handle_t lq = msu_avllq_lanes_create(lanes, 2);
+    g_assert_nonnull(lq);
+
+    int consumer_id = msu_avllq_lanes_register_consumer(lq);
+    g_assert_true(consumer_id >= 0);
+
+    msu_avllq_item_t item;
+    g_assert_true(msu_avllq_lanes_consume(lq, consumer_id, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_true(msu_avllq_lanes_consume_wait(lq, consumer_id, &item, 1000000) == MSU_AVLLQ_STATUS_TIMEOUT);
+
+    char data[4096];
+    memset(data, 0, sizeof(data));
+
+    /* a video burst interleaved with audio, the audio lane refuses to drop */
+    for (int i = 0; i < 10; i++) {
+        g_assert_true(msu_avllq_lanes_produce2(lq, data, sizeof(data), VIDEO) == MSU_AVLLQ_STATUS_OK);
+        if (i < 3) {
+            sprintf(data, "a%d", i);
+            g_assert_true(msu_avllq_lanes_produce2(lq, data, 64, AUDIO) == MSU_AVLLQ_STATUS_OK);
+        }
+    }
+    g_assert_true(msu_avllq_lanes_produce2(lq, data, 64, AUDIO) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_true(msu_avllq_lanes_produce2(lq, data, 64, 3) == MSU_AVLLQ_STATUS_ERR);
+
+    for (int i = 0; i < 3; i++) {
+        char expected[8];
+        sprintf(expected, "a%d", i);
+        g_assert_true(msu_avllq_lanes_consume_wait(lq, consumer_id, &item, 0) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(item.type, ==, AUDIO);
+        g_assert_cmpstr((char *)item.data, ==, expected);
+        msu_avllq_item_release(&item);
+    }
+
+    /* room again once the consumer has read */
+    g_assert_true(msu_avllq_lanes_produce2(lq, data, 64, AUDIO) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_lanes_consume(lq, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(item.type, ==, AUDIO);
+    msu_avllq_item_release(&item);
+
+    for (int i = 0; i < 3; i++) {
+        g_assert_true(msu_avllq_lanes_consume(lq, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(item.type, ==, VIDEO);
+        msu_avllq_item_release(&item);
+    }
+    g_assert_true(msu_avllq_lanes_consume(lq, consumer_id, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    int lane_consumer_id;
+    msu_avllq_stats_t stats;
+    msu_avllq_handle_t audio = msu_avllq_lanes_queue(lq, 0, consumer_id, &lane_consumer_id);
+    g_assert_true(msu_avllq_get_stats(audio, lane_consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.overrun, ==, 0);
+    msu_avllq_handle_t video = msu_avllq_lanes_queue(lq, 1, consumer_id, &lane_consumer_id);
+    g_assert_true(msu_avllq_get_stats(video, lane_consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.overrun, ==, 7);
+
+    msu_avllq_lanes_deregister_consumer(lq, consumer_id);
+    g_assert_true(msu_avllq_lanes_consume(lq, consumer_id, &item) == MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    /* no consumer, nothing to keep */
+    for (int i = 0; i < 5; i++) {
+        g_assert_true(msu_avllq_lanes_produce2(lq, data, 64, AUDIO) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    msu_avllq_lanes_destroy(lq);
+}
+
+#define GROUP_WORKERS   3
+#define GROUP_ITEMS     20000
+
+struct group_data_t {
+    msu_avllq_handle_t      q;
+    int                     consumer_id;
+    int                     done;
+    gint                    seen[GROUP_ITEMS];
+};
+
+static gpointer test_avllq_mt_consumer_group_worker(gpointer data)
+{
+    struct group_data_t *gd = (struct group_data_t *)data;
+    msu_avllq_item_t item;
+
+    for (;;) {
+        int done = g_atomic_int_get(&gd->done);
+        if (msu_avllq_consume_wait(gd->q, gd->consumer_id, &item, 10000000) != MSU_AVLLQ_STATUS_OK) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        uint32_t seq = *(uint32_t *)item.data;
+        g_assert_cmpint(seq, <, GROUP_ITEMS);
+        g_atomic_int_inc(&gd->seen[seq]);
+        msu_avllq_item_release(&item);
+    }
+
+    return NULL;
+}
+
+static void test_avllq_mt_consumer_group()
+{
+    msu_avllq_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.capacity = 64;
+    config.max_item_size = 256;
+    config.max_consumers = 2;
+    config.lossless = 1;
+
+    msu_avllq_handle_t q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+
+    /* a group takes one consumer entry however many members join */
+    msu_avllq_consumer_config_t consumer_config = { .group = 1 };
+    int group_id = msu_avllq_register_consumer2(q, &consumer_config);
+    g_assert_true(group_id >= 0);
+    for (int i = 1; i < GROUP_WORKERS; i++) {
+        g_assert_cmpint(msu_avllq_register_consumer2(q, &consumer_config), ==, group_id);
+    }
+
+    /* a second group still sees every item */
+    consumer_config.group = 2;
+    int observer_id = msu_avllq_register_consumer2(q, &consumer_config);
+    g_assert_true(observer_id >= 0);
+    g_assert_cmpint(observer_id, !=, group_id);
+    g_assert_cmpint(msu_avllq_register_consumer(q), ==, -1);
+
+    msu_avllq_item_t item;
+    g_assert_true(msu_avllq_borrow(q, group_id, &item) == MSU_AVLLQ_STATUS_ERR);
+    g_assert_true(msu_avllq_consume_latest(q, group_id, &item, NULL) == MSU_AVLLQ_STATUS_ERR);
+
+    struct group_data_t *gd = (struct group_data_t *)calloc(1, sizeof(*gd));
+    g_assert_nonnull(gd);
+    gd->q = q;
+    gd->consumer_id = group_id;
+
+    GThread *worker_thread[GROUP_WORKERS];
+    for (int i = 0; i < GROUP_WORKERS; i++) {
+        worker_thread[i] = g_thread_new("worker", test_avllq_mt_consumer_group_worker, gd);
+    }
+
+    uint32_t buf[64] = { 0 };
+    uint32_t observed = 0;
+
+    /* lossless, the producer waits for the slower of the workers and the observer */
+    for (uint32_t i = 0; i < GROUP_ITEMS; i++) {
+        buf[0] = i;
+        while (msu_avllq_produce2(q, buf, sizeof(buf), 0) == MSU_AVLLQ_STATUS_NO_BUF) {
+            while (msu_avllq_consume(q, observer_id, &item) == MSU_AVLLQ_STATUS_OK) {
+                g_assert_cmpint(*(uint32_t *)item.data, ==, observed++);
+                msu_avllq_item_release(&item);
+            }
+        }
+    }
+    while (msu_avllq_consume(q, observer_id, &item) == MSU_AVLLQ_STATUS_OK) {
+        g_assert_cmpint(*(uint32_t *)item.data, ==, observed++);
+        msu_avllq_item_release(&item);
+    }
+    g_assert_cmpint(observed, ==, GROUP_ITEMS);
+
+    g_atomic_int_set(&gd->done, 1);
+    for (int i = 0; i < GROUP_WORKERS; i++) {
+        g_thread_join(worker_thread[i]);
+    }
+
+    /* every item to exactly one worker */
+    for (int i = 0; i < GROUP_ITEMS; i++) {
+        g_assert_cmpint(gd->seen[i], ==, 1);
+    }
+
+    msu_avllq_stats_t stats;
+    g_assert_true(msu_avllq_get_stats(q, group_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.consumed, ==, GROUP_ITEMS);
+    g_assert_cmpint(stats.overrun, ==, 0);
+
+    /* the group stays until its last member leaves */
+    for (int i = 0; i < GROUP_WORKERS; i++) {
+        g_assert_true(msu_avllq_get_stats(q, group_id, &stats) == MSU_AVLLQ_STATUS_OK);
+        msu_avllq_deregister_consumer(q, group_id);
+    }
+    g_assert_true(msu_avllq_get_stats(q, group_id, &stats) == MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+    msu_avllq_deregister_consumer(q, observer_id);
+
+    free(gd);
+    msu_avllq_destroy(q);
+
+    /* groups need buffer mode without keyframe policy */
+    config.lossless = 0;
+    config.keyframe_policy = 1;
+    q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+    consumer_config.group = 1;
+    g_assert_cmpint(msu_avllq_register_consumer2(q, &consumer_config), ==, -1);
+    msu_avllq_destroy(q);
+}
+
+#define POLICY_ITEMS    1000
+
+static gpointer test_avllq_st_consumer_policy_recorder(gpointer data)
+{
+    struct producer_consumer_data_t *pcd = (struct producer_consumer_data_t *)data;
+    int consumer_id = pcd->start_flag;
+    msu_avllq_item_t item;
+
+    /* slower than the producer, which has to wait for every item */
+    for (uint32_t i = 0; i < POLICY_ITEMS; i++) {
+        g_assert_true(msu_avllq_consume_wait(pcd->q, consumer_id, &item, -1) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(*(uint32_t *)item.data, ==, i);
+        msu_avllq_item_release(&item);
+        if (i % 100 == 0) {
+            usleep(1000);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_avllq_st_consumer_policy()
+{
+    msu_avllq_handle_t q = msu_avllq_create(4, 64);
+    g_assert_nonnull(q);
+
+    msu_avllq_consumer_config_t recorder_config;
+    memset(&recorder_config, 0, sizeof(recorder_config));
+    recorder_config.policy = MSU_AVLLQ_POLICY_SPILL;
+
+    int preview_id = msu_avllq_register_consumer(q);
+    int recorder_id = msu_avllq_register_consumer2(q, &recorder_config);
+    g_assert_true(recorder_id >= 0);
+
+    msu_avllq_item_t item;
+    g_assert_true(msu_avllq_borrow(q, recorder_id, &item) == MSU_AVLLQ_STATUS_ERR);
+
+    /* 3 items fit in the window, the older ones are spilled for the recorder */
+    for (uint32_t i = 0; i < 10; i++) {
+        g_assert_cmpint(msu_avllq_produce2(q, &i, sizeof(i), 0), ==,
+                        i < 3 ? MSU_AVLLQ_STATUS_OK : MSU_AVLLQ_STATUS_SPILLED);
+    }
+
+    msu_avllq_stats_t stats;
+    g_assert_true(msu_avllq_get_stats(q, recorder_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.lag, ==, 10);
+    g_assert_cmpint(stats.overrun, ==, 0);
+
+    for (uint32_t i = 0; i < 10; i++) {
+        g_assert_true(msu_avllq_consume(q, recorder_id, &item) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(*(uint32_t *)item.data, ==, i);
+        msu_avllq_item_release(&item);
+    }
+    g_assert_true(msu_avllq_consume(q, recorder_id, &item) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    /* the preview consumer is not affected */
+    for (uint32_t i = 7; i < 10; i++) {
+        g_assert_true(msu_avllq_consume(q, preview_id, &item) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(*(uint32_t *)item.data, ==, i);
+        msu_avllq_item_release(&item);
+    }
+    g_assert_true(msu_avllq_get_stats(q, preview_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.overrun, ==, 7);
+
+    /* spill at most 2 items, the rest is dropped */
+    msu_avllq_deregister_consumer(q, recorder_id);
+    recorder_config.spill_limit = 2;
+    recorder_id = msu_avllq_register_consumer2(q, &recorder_config);
+    for (uint32_t i = 10; i < 20; i++) {
+        g_assert_cmpint(msu_avllq_produce2(q, &i, sizeof(i), 0), ==,
+                        i == 13 || i == 14 ? MSU_AVLLQ_STATUS_SPILLED : MSU_AVLLQ_STATUS_OK);
+    }
+
+    uint32_t expected[] = { 10, 11, 17, 18, 19 };
+    for (int i = 0; i < 5; i++) {
+        g_assert_true(msu_avllq_consume(q, recorder_id, &item) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(*(uint32_t *)item.data, ==, expected[i]);
+        msu_avllq_item_release(&item);
+    }
+    g_assert_true(msu_avllq_get_stats(q, recorder_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.overrun, ==, 5);
+
+    /* spilled items are freed on deregister */
+    for (uint32_t i = 20; i < 30; i++) {
+        msu_avllq_produce2(q, &i, sizeof(i), 0);
+    }
+    msu_avllq_deregister_consumer(q, recorder_id);
+
+    /* a blocking consumer holds the producer back until the timeout */
+    msu_avllq_consumer_config_t block_config;
+    memset(&block_config, 0, sizeof(block_config));
+    block_config.policy = MSU_AVLLQ_POLICY_BLOCK;
+    block_config.block_timeout_ns = 1000000;
+
+    int block_id = msu_avllq_register_consumer2(q, &block_config);
+    g_assert_true(block_id >= 0);
+    while (msu_avllq_consume(q, block_id, &item) == MSU_AVLLQ_STATUS_OK) {
+        msu_avllq_item_release(&item);
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    gint64 start = g_get_monotonic_time();
+    uint32_t value = 3;
+    g_assert_true(msu_avllq_produce2(q, &value, sizeof(value), 0) == MSU_AVLLQ_STATUS_TIMEOUT);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 1000);
+    g_assert_null(msu_avllq_reserve(q, sizeof(value)));
+
+    g_assert_true(msu_avllq_consume(q, block_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(*(uint32_t *)item.data, ==, 0);
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_produce2(q, &value, sizeof(value), 0) == MSU_AVLLQ_STATUS_OK);
+    msu_avllq_deregister_consumer(q, block_id);
+    msu_avllq_deregister_consumer(q, preview_id);
+
+    /* blocking consumers share one start, the producer waits for the longest timeout and not for their sum */
+    block_config.block_timeout_ns = 50000000;
+    int block_ids[2];
+    for (int i = 0; i < 2; i++) {
+        block_ids[i] = msu_avllq_register_consumer2(q, &block_config);
+        g_assert_true(block_ids[i] >= 0);
+        while (msu_avllq_consume(q, block_ids[i], &item) == MSU_AVLLQ_STATUS_OK) {
+            msu_avllq_item_release(&item);
+        }
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    start = g_get_monotonic_time();
+    g_assert_true(msu_avllq_produce2(q, &value, sizeof(value), 0) == MSU_AVLLQ_STATUS_TIMEOUT);
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 50000);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, 100000);
+    msu_avllq_deregister_consumer(q, block_ids[0]);
+
+    /* a zero timeout refuses the item at once */
+    block_config.block_timeout_ns = 0;
+    block_ids[0] = msu_avllq_register_consumer2(q, &block_config);
+    msu_avllq_deregister_consumer(q, block_ids[1]);
+    while (msu_avllq_consume(q, block_ids[0], &item) == MSU_AVLLQ_STATUS_OK) {
+        msu_avllq_item_release(&item);
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    start = g_get_monotonic_time();
+    g_assert_true(msu_avllq_produce2(q, &value, sizeof(value), 0) == MSU_AVLLQ_STATUS_TIMEOUT);
+    g_assert_cmpint(g_get_monotonic_time() - start, <, 50000);
+    msu_avllq_deregister_consumer(q, block_ids[0]);
+
+    /* waiting forever, the producer is woken up by the consumer and never drops */
+    block_config.block_timeout_ns = -1;
+    struct producer_consumer_data_t data;
+    data.q = q;
+    data.start_flag = msu_avllq_register_consumer2(q, &block_config);
+    while (msu_avllq_consume(q, data.start_flag, &item) == MSU_AVLLQ_STATUS_OK) {
+        msu_avllq_item_release(&item);
+    }
+
+    GThread *consumer_thread = g_thread_new("recorder", test_avllq_st_consumer_policy_recorder, &data);
+    for (uint32_t i = 0; i < POLICY_ITEMS; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+    g_thread_join(consumer_thread);
+
+    g_assert_true(msu_avllq_get_stats(q, data.start_flag, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.lag, ==, 0);
+    g_assert_cmpint(stats.overrun, ==, 0);
+    msu_avllq_deregister_consumer(q, data.start_flag);
+
+    msu_avllq_destroy(q);
+
+    /* no waiting for multiple producers */
+    msu_avllq_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.capacity = 8;
+    config.max_item_size = 64;
+    config.producers = 2;
+    q = msu_avllq_create2(&config);
+    g_assert_nonnull(q);
+    g_assert_cmpint(msu_avllq_register_consumer2(q, &block_config), ==, -1);
+    msu_avllq_destroy(q);
+}
+
+#define OUT_BLOCKS      2
+#define OUT_BLOCK_SIZE  256
+
+struct out_pool_t {
+    uint8_t     blocks[OUT_BLOCKS][OUT_BLOCK_SIZE];
+    int         used[OUT_BLOCKS];
+    int         allocs;
+    int         frees;
+};
+
+static void *test_out_alloc(void *ctx, size_t size)
+{
+    struct out_pool_t *pool = (struct out_pool_t *)ctx;
+
+    g_assert_cmpint(size, <=, OUT_BLOCK_SIZE);
+    for (int i = 0; i < OUT_BLOCKS; i++) {
+        if (!pool->used[i]) {
+            pool->used[i] = 1;
+            pool->allocs++;
+            return pool->blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void test_out_free(void *ctx, void *ptr)
+{
+    struct out_pool_t *pool = (struct out_pool_t *)ctx;
+
+    for (int i = 0; i < OUT_BLOCKS; i++) {
+        if (ptr == pool->blocks[i]) {
+            g_assert_true(pool->used[i]);
+            pool->used[i] = 0;
+            pool->frees++;
+            return;
+        }
+    }
+
+    g_assert_true(0);
+}
+
+static void test_avllq_st_output_pool()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 64);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+    msu_avllq_item_t item;
+    msu_avllq_item_t items[4];
+    size_t count;
+
+    /* released buffers are reused by the next consume */
+    for (uint32_t i = 0; i < 6; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    void *data = item.data;
+    msu_avllq_item_release(&item);
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(item.data == data);
+    g_assert_cmpint(*(uint32_t *)item.data, ==, 1);
+    msu_avllq_item_release(&item);
+
+    g_assert_true(msu_avllq_consume_n(q, consumer_id, items, 4, &count) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(count, ==, 4);
+    g_assert_true(items[0].data == data);
+    for (size_t i = 0; i < count; i++) {
+        g_assert_cmpint(*(uint32_t *)items[i].data, ==, i + 2);
+    }
+
+    /* items may outlive their consumer and the queue */
+    msu_avllq_item_release(&items[0]);
+    msu_avllq_deregister_consumer(q, consumer_id);
+    msu_avllq_item_release(&items[1]);
+
+    /* a caller allocator takes over the buffers */
+    struct out_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+
+    msu_avllq_consumer_config_t consumer_config;
+    memset(&consumer_config, 0, sizeof(consumer_config));
+    consumer_config.out_alloc = test_out_alloc;
+    consumer_config.out_free = test_out_free;
+    consumer_config.out_ctx = &pool;
+
+    /* half an allocator is refused rather than falling back to the free list */
+    consumer_config.out_free = NULL;
+    g_assert_cmpint(msu_avllq_register_consumer2(q, &consumer_config), ==, -1);
+    consumer_config.out_alloc = NULL;
+    consumer_config.out_free = test_out_free;
+    g_assert_cmpint(msu_avllq_register_consumer2(q, &consumer_config), ==, -1);
+    consumer_config.out_alloc = test_out_alloc;
+
+    consumer_id = msu_avllq_register_consumer2(q, &consumer_config);
+    g_assert_true(consumer_id >= 0);
+    for (uint32_t i = 6; i < 9; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    g_assert_true(msu_avllq_consume_n(q, consumer_id, items, 4, &count) == MSU_AVLLQ_STATUS_MEMORY_ERR);
+    g_assert_cmpint(count, ==, 2);
+    g_assert_cmpint(pool.allocs, ==, 2);
+    for (size_t i = 0; i < count; i++) {
+        g_assert_true((uint8_t *)items[i].data > pool.blocks[i] &&
+                      (uint8_t *)items[i].data < pool.blocks[i] + OUT_BLOCK_SIZE);
+        g_assert_cmpint(*(uint32_t *)items[i].data, ==, i + 6);
+        msu_avllq_item_release(&items[i]);
+    }
+    g_assert_cmpint(pool.frees, ==, 2);
+
+    g_assert_true(msu_avllq_consume(q, consumer_id, &item) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(*(uint32_t *)item.data, ==, 8);
+
+    msu_avllq_destroy(q);
+
+    msu_avllq_item_release(&item);
+    msu_avllq_item_release(&items[2]);
+    msu_avllq_item_release(&items[3]);
+    g_assert_cmpint(pool.allocs, ==, pool.frees);
+}
+
+static void test_avllq_st_consume_into()
+{
+    msu_avllq_handle_t q = msu_avllq_create(8, 64);
+    g_assert_nonnull(q);
+
+    int consumer_id = msu_avllq_register_consumer(q);
+    char dst[64];
+    size_t len;
+    int type;
+
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, dst, sizeof(dst), &len, &type) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    g_assert_true(msu_avllq_produce2(q, "frame 1", 8, 1) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_produce2(q, "frame 2 is long", 16, 2) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(msu_avllq_produce2(q, "frame 3", 8, 3) == MSU_AVLLQ_STATUS_OK);
+
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, dst, sizeof(dst), &len, &type) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(len, ==, 8);
+    g_assert_cmpint(type, ==, 1);
+    g_assert_cmpstr(dst, ==, "frame 1");
+
+    /* too small, the head is copied and the item consumed */
+    memset(dst, 'x', sizeof(dst));
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, dst, 8, &len, &type) == MSU_AVLLQ_STATUS_TRUNCATED);
+    g_assert_cmpint(len, ==, 16);
+    g_assert_cmpint(type, ==, 2);
+    g_assert_true(memcmp(dst, "frame 2 ", 8) == 0);
+    g_assert_cmpint(dst[8], ==, 'x');
+
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, dst, sizeof(dst), NULL, NULL) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpstr(dst, ==, "frame 3");
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, dst, sizeof(dst), &len, &type) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    msu_avllq_stats_t stats;
+    g_assert_true(msu_avllq_get_stats(q, consumer_id, &stats) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(stats.consumed, ==, 3);
+
+    /* overrun items are skipped like consume does */
+    for (uint32_t i = 0; i < 20; i++) {
+        g_assert_true(msu_avllq_produce2(q, &i, sizeof(i), 0) == MSU_AVLLQ_STATUS_OK);
+    }
+    uint32_t value;
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, &value, sizeof(value), &len, NULL) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(value, ==, 13);
+
+    msu_avllq_deregister_consumer(q, consumer_id);
+    g_assert_true(msu_avllq_consume_into(q, consumer_id, dst, sizeof(dst), &len, &type) ==
+                  MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    msu_avllq_destroy(q);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -688,5 +2435,77 @@ int main(int argc, char *argv[])
     g_test_add_func("/miscutil/avllq/test_avllq_no_producer_buf_malloc",
                     test_avllq_no_producer_buf_malloc);
 
+    g_test_add_func("/miscutil/avllq/test_avllq_mt_lockfree_overwrite",
+                    test_avllq_mt_lockfree_overwrite);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_borrow_and_return",
+                    test_avllq_st_borrow_and_return);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_mt_borrow_while_overwrite",
+                    test_avllq_mt_borrow_while_overwrite);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_reserve_and_commit",
+                    test_avllq_st_reserve_and_commit);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_consume_wait_timeout",
+                    test_avllq_st_consume_wait_timeout);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_mt_consume_wait",
+                    test_avllq_mt_consume_wait);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_consumer_fd",
+                    test_avllq_st_consumer_fd);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_mt_consumer_fd",
+                    test_avllq_mt_consumer_fd);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_large_capacity_and_read_seq",
+                    test_avllq_st_large_capacity_and_read_seq);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_many_consumers",
+                    test_avllq_st_many_consumers);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_produce_n_and_consume_n",
+                    test_avllq_st_produce_n_and_consume_n);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_producev",
+                    test_avllq_st_producev);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_slab",
+                    test_avllq_st_slab);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_byte_ring",
+                    test_avllq_st_byte_ring);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_keyframe_policy",
+                    test_avllq_st_keyframe_policy);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_consume_latest",
+                    test_avllq_st_consume_latest);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_consumer_stats",
+                    test_avllq_st_consumer_stats);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_latency_histogram",
+                    test_avllq_st_latency_histogram);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_mt_multi_producer",
+                    test_avllq_mt_multi_producer);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_lanes",
+                    test_avllq_st_lanes);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_mt_consumer_group",
+                    test_avllq_mt_consumer_group);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_consumer_policy",
+                    test_avllq_st_consumer_policy);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_output_pool",
+                    test_avllq_st_output_pool);
+
+    g_test_add_func("/miscutil/avllq/test_avllq_st_consume_into",
+                    test_avllq_st_consume_into);
+
     return g_test_run();
 }
@@ -0,0 +1,215 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <glib.h>
+#include "avllq.hpp"
+
+struct test_frame_t {
+    uint32_t seq;
+    uint32_t words[63];
+
+    test_frame_t() = default;
+    test_frame_t(uint32_t s) : seq(s)
+    {
+        for (int i = 0; i < 63; i++) {
+            words[i] = s;
+        }
+    }
+};
+
+typedef msu::avllq<test_frame_t, 8, 4> test_queue_t;
+
+static void test_avllq_hpp_register_and_deregister_consumer()
+{
+    test_queue_t *q = new test_queue_t();
+
+    int ids[4];
+    for (int i = 0; i < 4; i++) {
+        ids[i] = q->register_consumer();
+        g_assert_true(ids[i] >= 0);
+    }
+    g_assert_cmpint(q->register_consumer(), ==, -1);
+
+    g_assert_true(q->deregister_consumer(ids[1]) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(q->deregister_consumer(ids[1]) == MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    /* the slot is reused with a new id, the stale one stays invalid */
+    int id = q->register_consumer();
+    g_assert_true(id >= 0);
+    g_assert_cmpint(id, !=, ids[1]);
+
+    test_frame_t frame;
+    g_assert_true(q->consume(ids[1], frame) == MSU_AVLLQ_STATUS_CONSUMER_NOT_FOUND);
+
+    delete q;
+}
+
+static void test_avllq_hpp_st_produce_and_consume()
+{
+    test_queue_t *q = new test_queue_t();
+
+    int consumer_id = q->register_consumer();
+    test_frame_t frame;
+
+    g_assert_true(q->consume(consumer_id, frame) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_true(q->empty(consumer_id));
+
+    g_assert_true(q->produce(test_frame_t(1)) == MSU_AVLLQ_STATUS_OK);
+    test_frame_t two(2);
+    g_assert_true(q->produce(two) == MSU_AVLLQ_STATUS_OK);
+    g_assert_true(q->emplace(3u) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(q->buf_size(consumer_id), ==, 3);
+
+    for (uint32_t i = 1; i <= 3; i++) {
+        g_assert_true(q->consume(consumer_id, &frame) == MSU_AVLLQ_STATUS_OK);
+        g_assert_cmpint(frame.seq, ==, i);
+        g_assert_cmpint(frame.words[62], ==, i);
+    }
+    g_assert_true(q->consume(consumer_id, frame) == MSU_AVLLQ_STATUS_NO_BUF);
+
+    /* overrun, only capacity - 1 latest are left */
+    for (uint32_t i = 4; i <= 20; i++) {
+        q->produce(test_frame_t(i));
+    }
+    g_assert_cmpint(q->buf_size(consumer_id), ==, test_queue_t::capacity - 1);
+
+    test_frame_t frames[4];
+    size_t count;
+    g_assert_true(q->consume_n(consumer_id, frames, 4, &count) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(count, ==, 4);
+    for (size_t i = 0; i < count; i++) {
+        g_assert_cmpint(frames[i].seq, ==, 14 + i);
+    }
+
+    uint64_t skipped;
+    g_assert_true(q->consume_latest(consumer_id, frame, &skipped) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(frame.seq, ==, 20);
+    g_assert_cmpint(skipped, ==, 2);
+    g_assert_true(q->consume_latest(consumer_id, frame, &skipped) == MSU_AVLLQ_STATUS_NO_BUF);
+    g_assert_cmpint(q->slowest_rd_seq(), ==, 20);
+
+    delete q;
+}
+
+static void test_avllq_hpp_register_start()
+{
+    test_queue_t *q = new test_queue_t();
+    test_frame_t frame;
+
+    int consumer_id1 = q->register_consumer();
+    for (uint32_t i = 1; i <= 5; i++) {
+        g_assert_true(q->emplace(i) == MSU_AVLLQ_STATUS_OK);
+    }
+    for (uint32_t i = 1; i <= 3; i++) {
+        g_assert_true(q->consume(consumer_id1, frame) == MSU_AVLLQ_STATUS_OK);
+    }
+
+    /* starts at the slowest live consumer, not at the oldest item, same as msu_avllq_register_consumer() */
+    int consumer_id2 = q->register_consumer();
+    g_assert_cmpint(q->buf_size(consumer_id2), ==, 2);
+    g_assert_true(q->consume(consumer_id2, frame) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(frame.seq, ==, 4);
+
+    /* the position of deregistered consumers is kept */
+    q->deregister_consumer(consumer_id1);
+    q->deregister_consumer(consumer_id2);
+    int consumer_id3 = q->register_consumer();
+    g_assert_cmpint(q->buf_size(consumer_id3), ==, 1);
+    g_assert_true(q->consume(consumer_id3, frame) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(frame.seq, ==, 5);
+    q->deregister_consumer(consumer_id3);
+
+    /* but never before the oldest readable item */
+    for (uint32_t i = 6; i <= 20; i++) {
+        g_assert_true(q->emplace(i) == MSU_AVLLQ_STATUS_OK);
+    }
+    int consumer_id4 = q->register_consumer();
+    g_assert_true(q->consume(consumer_id4, frame) == MSU_AVLLQ_STATUS_OK);
+    g_assert_cmpint(frame.seq, ==, 14);
+
+    delete q;
+}
+
+#define HPP_TEST_ITEMS      200000
+
+struct test_hpp_data_t {
+    test_queue_t *q;
+    gint start_flag;
+};
+
+static gpointer test_avllq_hpp_mt_producer(gpointer data)
+{
+    test_hpp_data_t *d = (test_hpp_data_t *)data;
+
+    while (g_atomic_int_get(&d->start_flag) < 2) {
+        usleep(1000);
+    }
+
+    for (uint32_t i = 1; i <= HPP_TEST_ITEMS; i++) {
+        d->q->emplace(i);
+    }
+
+    return NULL;
+}
+
+static gpointer test_avllq_hpp_mt_consumer(gpointer data)
+{
+    test_hpp_data_t *d = (test_hpp_data_t *)data;
+
+    int consumer_id = d->q->register_consumer();
+    g_assert_true(consumer_id >= 0);
+
+    g_atomic_int_inc(&d->start_flag);
+
+    test_frame_t frame;
+    uint32_t last = 0;
+
+    while (last < HPP_TEST_ITEMS) {
+        if (d->q->consume(consumer_id, frame) != MSU_AVLLQ_STATUS_OK) {
+            continue;
+        }
+
+        /* never torn, never out of order */
+        for (int j = 0; j < 63; j++) {
+            g_assert_cmpint(frame.words[j], ==, frame.seq);
+        }
+        g_assert_cmpint(frame.seq, >, last);
+        last = frame.seq;
+    }
+
+    d->q->deregister_consumer(consumer_id);
+
+    return NULL;
+}
+
+static void test_avllq_hpp_mt_lockfree_overwrite()
+{
+    test_hpp_data_t data;
+    data.q = new test_queue_t();
+    data.start_flag = 0;
+
+    GThread *producer_thread = g_thread_new("producer", test_avllq_hpp_mt_producer, &data);
+    GThread *consumer_thread1 = g_thread_new("consumer1", test_avllq_hpp_mt_consumer, &data);
+    GThread *consumer_thread2 = g_thread_new("consumer2", test_avllq_hpp_mt_consumer, &data);
+
+    g_thread_join(producer_thread);
+    g_thread_join(consumer_thread1);
+    g_thread_join(consumer_thread2);
+
+    delete data.q;
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/miscutil/avllq_hpp/test_avllq_hpp_register_and_deregister_consumer",
+                    test_avllq_hpp_register_and_deregister_consumer);
+    g_test_add_func("/miscutil/avllq_hpp/test_avllq_hpp_st_produce_and_consume",
+                    test_avllq_hpp_st_produce_and_consume);
+    g_test_add_func("/miscutil/avllq_hpp/test_avllq_hpp_register_start",
+                    test_avllq_hpp_register_start);
+    g_test_add_func("/miscutil/avllq_hpp/test_avllq_hpp_mt_lockfree_overwrite",
+                    test_avllq_hpp_mt_lockfree_overwrite);
+
+    return g_test_run();
+}